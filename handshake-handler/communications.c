@@ -133,6 +133,19 @@ int tb_send_certificate_query(handler_state_t* state, unsigned char* certificate
 		nlmsg_free(skb);
 		return -1;
 	}
+	/* The state pointer goes first so the policy engine can still answer
+	 * a query too large for it to receive whole */
+	sema_init(&state->sem, 0);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+	rc = nla_put_u64_64bit(skb, TRUSTBASE_A_STATE_PTR, (uint64_t)state, TRUSTBASE_A_PAD);
+#else
+	rc = nla_put_u64(skb, TRUSTBASE_A_STATE_PTR, (uint64_t)state);
+#endif
+	if (rc != 0) {
+		ktblog(LOG_ERROR, "failed in nla_put (sem)");
+		nlmsg_free(skb);
+		return -1;
+	}
 	ktblog(LOG_DEBUG, "Trying to send client hello of length %d", state->client_hello_len);
 	rc = nla_put(skb, TRUSTBASE_A_CLIENT_HELLO, state->client_hello_len, state->client_hello);
 	if (rc != 0) {
@@ -170,18 +183,6 @@ int tb_send_certificate_query(handler_state_t* state, unsigned char* certificate
 		return -1;
 	}
 
-	sema_init(&state->sem, 0);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
-	rc = nla_put_u64_64bit(skb, TRUSTBASE_A_STATE_PTR, (uint64_t)state, TRUSTBASE_A_PAD);
-#else
-	rc = nla_put_u64(skb, TRUSTBASE_A_STATE_PTR, (uint64_t)state);
-#endif
-	if (rc != 0) {
-		ktblog(LOG_ERROR, "failed in nla_put (sem)");
-		nlmsg_free(skb);
-		return -1;
-	}
-
 	genlmsg_end(skb, msg_head);
 	// skbs are freed by genlmsg_multicast
 	rc = genlmsg_multicast(&tb_family, skb, 0, TRUSTBASE_QUERY, GFP_ATOMIC);
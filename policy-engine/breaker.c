@@ -0,0 +1,114 @@
+#include <time.h>
+#include "breaker.h"
+
+/* While half-open every BREAKER_PROBE_INTERVAL-th query is let through,
+ * and BREAKER_PROBE_SUCCESSES successes in a row close the breaker */
+#define BREAKER_PROBE_INTERVAL	10
+#define BREAKER_PROBE_SUCCESSES	3
+
+static uint64_t now_ms(void);
+
+/**
+ * Sets up a closed breaker
+ * @param threshold consecutive failures that open it, 0 to never open
+ * @param cooldown_ms how long it stays open before probing
+ */
+void breaker_init(breaker_t* breaker, int threshold, unsigned int cooldown_ms) {
+	pthread_mutex_init(&breaker->mutex, NULL);
+	breaker->state = BREAKER_CLOSED;
+	breaker->threshold = threshold;
+	breaker->cooldown_ms = cooldown_ms;
+	breaker->failures = 0;
+	breaker->successes = 0;
+	breaker->probe_counter = 0;
+	breaker->opened_at = 0;
+	breaker->trips = 0;
+	return;
+}
+
+/**
+ * Decides whether a query may be sent to the plugin
+ * @returns 1 if it may, 0 if the plugin should be skipped
+ */
+int breaker_allow(breaker_t* breaker) {
+	int allow;
+	if (breaker->threshold == 0) {
+		return 1;
+	}
+	pthread_mutex_lock(&breaker->mutex);
+	allow = 1;
+	if (breaker->state == BREAKER_OPEN) {
+		if (now_ms() - breaker->opened_at < breaker->cooldown_ms) {
+			allow = 0;
+		}
+		else {
+			breaker->state = BREAKER_HALF_OPEN;
+			breaker->successes = 0;
+			breaker->probe_counter = 0;
+		}
+	}
+	if (breaker->state == BREAKER_HALF_OPEN) {
+		allow = breaker->probe_counter++ % BREAKER_PROBE_INTERVAL == 0;
+	}
+	pthread_mutex_unlock(&breaker->mutex);
+	return allow;
+}
+
+/**
+ * Records the outcome of a query that was sent to the plugin
+ * @param failed nonzero if the plugin returned an error or timed out
+ */
+void breaker_record(breaker_t* breaker, int failed) {
+	if (breaker->threshold == 0) {
+		return;
+	}
+	pthread_mutex_lock(&breaker->mutex);
+	if (!failed) {
+		breaker->failures = 0;
+		if (breaker->state == BREAKER_HALF_OPEN && ++breaker->successes >= BREAKER_PROBE_SUCCESSES) {
+			breaker->state = BREAKER_CLOSED;
+		}
+	}
+	else if (breaker->state == BREAKER_HALF_OPEN || (breaker->state == BREAKER_CLOSED && ++breaker->failures >= breaker->threshold)) {
+		/* A failed probe starts a new cool-down */
+		breaker->state = BREAKER_OPEN;
+		breaker->opened_at = now_ms();
+		breaker->failures = 0;
+		breaker->trips++;
+	}
+	pthread_mutex_unlock(&breaker->mutex);
+	return;
+}
+
+/**
+ * @param trips if not NULL, receives how often the breaker has opened
+ * @returns the breaker's current state
+ */
+int breaker_state(breaker_t* breaker, unsigned int* trips) {
+	int state;
+	pthread_mutex_lock(&breaker->mutex);
+	state = breaker->state;
+	if (trips != NULL) {
+		*trips = breaker->trips;
+	}
+	pthread_mutex_unlock(&breaker->mutex);
+	return state;
+}
+
+const char* breaker_state_name(int state) {
+	switch (state) {
+		case BREAKER_CLOSED:
+			return "closed";
+		case BREAKER_OPEN:
+			return "open";
+		case BREAKER_HALF_OPEN:
+			return "half-open";
+	}
+	return "unknown";
+}
+
+uint64_t now_ms(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,38 @@
+#ifndef _BREAKER_H
+#define _BREAKER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define DEFAULT_BREAKER_THRESHOLD	5
+#define DEFAULT_BREAKER_COOLDOWN	30000 // in milliseconds
+
+enum {
+	BREAKER_CLOSED,
+	BREAKER_OPEN,
+	BREAKER_HALF_OPEN,
+};
+
+/* Per-plugin circuit breaker.  After threshold consecutive failures the
+ * breaker opens and the plugin is skipped for cooldown_ms.  It then lets
+ * a fraction of queries through as probes and closes again once enough
+ * of them succeed */
+typedef struct breaker_t {
+	pthread_mutex_t mutex;
+	int state;
+	int threshold; /* 0 disables the breaker */
+	unsigned int cooldown_ms;
+	int failures;
+	int successes;
+	unsigned int probe_counter;
+	uint64_t opened_at; /* CLOCK_MONOTONIC milliseconds */
+	unsigned int trips;
+} breaker_t;
+
+void breaker_init(breaker_t* breaker, int threshold, unsigned int cooldown_ms);
+int breaker_allow(breaker_t* breaker);
+void breaker_record(breaker_t* breaker, int failed);
+int breaker_state(breaker_t* breaker, unsigned int* trips);
+const char* breaker_state_name(int state);
+
+#endif
@@ -10,23 +10,51 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 #include <openssl/pem.h>
 #include <string.h>
 #include <fnmatch.h>
 #include <openssl/evp.h>
+#include <openssl/sha.h>
 #include <sys/utsname.h>
+#include <pthread.h>
+#include <time.h>
 #include "trustbase_plugin.h"
 #include "tb_logging.h"
 #include "ca_validation.h"
 #include "openssl_hostname_validation.h"
+#include "cert_intern.h"
 
 #define MAX_LENGTH 1024
 
 static char root_store_filename_redhat[] = "ca-bundle.crt";
 static char root_store_filename_debian[] = "ca-certificates.crt";
 
+/* Signatures already checked between a certificate and its issuer, so
+ * that the intermediates most chains share are only verified once.  An
+ * edge is keyed by the SHA-256 of both certificates' DER encodings and
+ * kept until the earlier of their expiry dates.  The table is direct
+ * mapped: a colliding edge simply replaces the older one */
+typedef struct verified_edge_t {
+	unsigned char key[SHA256_DIGEST_LENGTH];
+	time_t expires; /* 0 for an empty slot */
+} verified_edge_t;
+
+static struct {
+	pthread_mutex_t mutex;
+	verified_edge_t* edges;
+	size_t mask;
+} edge_cache = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+
+static int verify_signatures(X509_STORE_CTX* ctx);
+static int check_signing_allowed(X509_STORE_CTX* ctx, X509* subject, X509* issuer, int depth);
+static int check_signature(X509_STORE_CTX* ctx, X509* subject, X509* issuer, int depth);
+static int check_time(X509_STORE_CTX* ctx, X509* cert, int depth);
+static int report_error(X509_STORE_CTX* ctx, X509* cert, int depth, int error);
+static int edge_key(X509* subject, X509* issuer, unsigned char* key);
+static time_t edge_expiry(X509* subject, X509* issuer);
 static void print_certificate(X509* cert);
 static void print_chain(STACK_OF(X509)*);
 static const char* get_validation_errstr(long e);
@@ -37,20 +65,29 @@ static const char* get_validation_errstr(long e);
  * @return a X509_STORE pointer containing the root CA system store.
  */
 X509_STORE* make_new_root_store() {
+	X509_STORE* store;
+	char* root_store_full_path;
+	root_store_full_path = default_root_store_path();
+	if (root_store_full_path == NULL) {
+		return NULL;
+	}
+	store = load_root_store(root_store_full_path);
+	free(root_store_full_path);
+	return store;
+}
+
+/** This function guesses where the distribution keeps its CA bundle.
+ * Only redhat and debian are supported for now.
+ *
+ * @return a newly allocated path the caller must free, or NULL on failure
+ */
+char* default_root_store_path() {
 	struct utsname info;
 	size_t root_store_dir_len;
 	const char* root_store_dir;
 	char* root_store_full_path;
 	char* root_store_filename;
 	size_t root_store_filename_len;
-	X509_STORE* store;
-	
-	/* create a new store */
-	store = X509_STORE_new();
-	if (store == NULL) {
-		tblog(LOG_ERROR, "Unable to create new X509 store");
-		return NULL;
-	}
 	
 	/* Attempt to discover root store location based on distro 
 	 * Only support redhat and debian for now. */
@@ -72,18 +109,39 @@ X509_STORE* make_new_root_store() {
 	root_store_dir_len = strlen(root_store_dir);
 	root_store_filename_len = strlen(root_store_filename);
 	root_store_full_path = (char *)malloc(root_store_dir_len + root_store_filename_len + 2); /* +1 for NULL, +1 for / */
+	if (root_store_full_path == NULL) {
+		tblog(LOG_ERROR, "Unable to allocate the root store path");
+		return NULL;
+	}
 	sprintf(root_store_full_path, "%s/%s", root_store_dir, root_store_filename);
-	tblog(LOG_INFO, "Policy Engine is using root store found at %s\n", root_store_full_path);
+	return root_store_full_path;
+}
+
+/** This function returns a new X509_STORE* holding the certificates of a CA bundle.
+ * You must free this STORE after use with X509_STORE_free.
+ *
+ * @param path PEM file containing the trusted root certificates
+ * @return a X509_STORE pointer, or NULL if the bundle could not be read
+ */
+X509_STORE* load_root_store(const char* path) {
+	X509_STORE* store;
+	
+	/* create a new store */
+	store = X509_STORE_new();
+	if (store == NULL) {
+		tblog(LOG_ERROR, "Unable to create new X509 store");
+		return NULL;
+	}
+	tblog(LOG_INFO, "Policy Engine is using root store found at %s\n", path);
 	
 	/* load the store */
-	if (X509_STORE_load_locations(store, root_store_full_path, NULL) < 1) {
-		tblog(LOG_ERROR, "Unable to read the certificate store at %s", root_store_full_path);
+	if (X509_STORE_load_locations(store, path, NULL) < 1) {
+		tblog(LOG_ERROR, "Unable to read the certificate store at %s", path);
 		X509_STORE_free(store);
 		return NULL;
 	}
 
 	OpenSSL_add_all_algorithms();
-	free(root_store_full_path);
 	return store;
 }
 
@@ -98,7 +156,6 @@ int query_store(const char* hostname, STACK_OF(X509)* chain, X509_STORE* root_st
 	X509* cert;
 	X509_STORE_CTX* ctx;
 	X509_STORE* store;
-	int i;
 	int valid;
 
 	if (sk_X509_num(chain) <= 0) {
@@ -116,7 +173,7 @@ int query_store(const char* hostname, STACK_OF(X509)* chain, X509_STORE* root_st
 	store = root_store;
 	
 	//for (i=sk_X509_num(chain)-1; i>=0; i--) {
-	cert = sk_X509_value(chain, i);
+	cert = sk_X509_value(chain, 0);
 	ctx = X509_STORE_CTX_new();
 	if (!ctx) {
 		tblog(LOG_ERROR, "Unable to create new X509_STORE_CTX");
@@ -129,6 +186,11 @@ int query_store(const char* hostname, STACK_OF(X509)* chain, X509_STORE* root_st
 		X509_STORE_CTX_free(ctx);
 		return PLUGIN_RESPONSE_INVALID;
 	}
+	/* Path building, purpose and trust checks stay OpenSSL's, only the
+	 * signature and time checks go through the edge cache */
+	if (edge_cache.edges != NULL) {
+		X509_STORE_CTX_set_verify(ctx, verify_signatures);
+	}
 	
 	/* Verify the build certificate context */
 	valid = X509_verify_cert(ctx);
@@ -157,6 +219,234 @@ int query_store(const char* hostname, STACK_OF(X509)* chain, X509_STORE* root_st
 	return PLUGIN_RESPONSE_VALID;
 }
 
+/** This function enables the cache of verified issuer signatures
+ *
+ * @param size number of edges kept, rounded up to a power of two. 0 leaves the cache disabled.
+ * @return 0 on success, 1 on failure
+ */
+int edge_cache_init(size_t size) {
+	size_t slots;
+	if (size == 0) {
+		return 0;
+	}
+	slots = 2;
+	while (slots < size) {
+		slots <<= 1;
+	}
+	edge_cache.edges = (verified_edge_t*)calloc(slots, sizeof(verified_edge_t));
+	if (edge_cache.edges == NULL) {
+		tblog(LOG_ERROR, "Failed to allocate %zu entries for the verified edge cache", slots);
+		return 1;
+	}
+	edge_cache.mask = slots - 1;
+	return 0;
+}
+
+/** This function forgets every verified edge, e.g. after the root store was reloaded
+ */
+void edge_cache_flush(void) {
+	if (edge_cache.edges == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&edge_cache.mutex);
+	memset(edge_cache.edges, 0, sizeof(verified_edge_t) * (edge_cache.mask + 1));
+	pthread_mutex_unlock(&edge_cache.mutex);
+}
+
+void edge_cache_free(void) {
+	free(edge_cache.edges);
+	edge_cache.edges = NULL;
+}
+
+/* Replacement for OpenSSL's internal_verify, which checks each signature
+ * along the chain OpenSSL built and each certificate's validity period.
+ * It behaves the same except that signatures between a certificate and
+ * an issuer already verified together are taken from the edge cache.
+ * The leaf's signature is always checked. */
+int verify_signatures(X509_STORE_CTX* ctx) {
+	STACK_OF(X509)* chain;
+	X509* issuer;
+	X509* subject;
+	int n;
+	chain = X509_STORE_CTX_get0_chain(ctx);
+	n = sk_X509_num(chain) - 1;
+	issuer = sk_X509_value(chain, n);
+	/* Trust anchors are not checked against themselves unless asked */
+	if (X509_check_issued(issuer, issuer) == X509_V_OK) {
+		subject = issuer;
+	}
+	else if (X509_VERIFY_PARAM_get_flags(X509_STORE_CTX_get0_param(ctx)) & X509_V_FLAG_PARTIAL_CHAIN) {
+		subject = issuer;
+	}
+	else {
+		if (n <= 0) {
+			return report_error(ctx, issuer, 0, X509_V_ERR_UNABLE_TO_VERIFY_LEAF_SIGNATURE);
+		}
+		n--;
+		subject = sk_X509_value(chain, n);
+	}
+	while (n >= 0) {
+		if (subject != issuer || (X509_VERIFY_PARAM_get_flags(X509_STORE_CTX_get0_param(ctx)) & X509_V_FLAG_CHECK_SS_SIGNATURE)) {
+			if (!check_signing_allowed(ctx, subject, issuer, n)) {
+				return 0;
+			}
+			if (!check_signature(ctx, subject, issuer, n)) {
+				return 0;
+			}
+		}
+		if (!check_time(ctx, subject, n)) {
+			return 0;
+		}
+		X509_STORE_CTX_set_current_cert(ctx, subject);
+		X509_STORE_CTX_set_error_depth(ctx, n);
+		if (!X509_STORE_CTX_get_verify_cb(ctx)(1, ctx)) {
+			return 0;
+		}
+		if (--n >= 0) {
+			issuer = subject;
+			subject = sk_X509_value(chain, n);
+		}
+	}
+	return 1;
+}
+
+/* Checks that the issuer's key usage allows it to sign subject, as
+ * OpenSSL 3's internal_verify does (RFC 5280 6.1.4 (n)).  A self-issued
+ * end-entity certificate at the top of the chain is exempt.  Returns 0 if
+ * verification must stop */
+int check_signing_allowed(X509_STORE_CTX* ctx, X509* subject, X509* issuer, int depth) {
+	uint32_t flags;
+	uint32_t usage;
+	int error;
+	flags = X509_get_extension_flags(issuer);
+	if (subject == issuer && !(flags & EXFLAG_CA)) {
+		return 1;
+	}
+	if (!(flags & EXFLAG_KUSAGE)) {
+		return 1;
+	}
+	usage = X509_get_key_usage(issuer);
+	if (X509_get_extension_flags(subject) & EXFLAG_PROXY) {
+		if (usage & KU_DIGITAL_SIGNATURE) {
+			return 1;
+		}
+		error = X509_V_ERR_KEYUSAGE_NO_DIGITAL_SIGNATURE;
+	}
+	else {
+		if (usage & KU_KEY_CERT_SIGN) {
+			return 1;
+		}
+		error = X509_V_ERR_KEYUSAGE_NO_CERTSIGN;
+	}
+	return report_error(ctx, issuer, subject != issuer ? depth + 1 : depth, error);
+}
+
+/* Checks that issuer signed subject, consulting the edge cache for every
+ * certificate but the leaf.  Returns 0 if verification must stop */
+int check_signature(X509_STORE_CTX* ctx, X509* subject, X509* issuer, int depth) {
+	unsigned char key[SHA256_DIGEST_LENGTH];
+	verified_edge_t* edge;
+	EVP_PKEY* pkey;
+	time_t now;
+	size_t hash;
+	int cacheable;
+	cacheable = depth > 0 && edge_key(subject, issuer, key);
+	if (cacheable) {
+		memcpy(&hash, key, sizeof(hash));
+		now = time(NULL);
+		pthread_mutex_lock(&edge_cache.mutex);
+		edge = &edge_cache.edges[hash & edge_cache.mask];
+		if (edge->expires > now && memcmp(edge->key, key, sizeof(key)) == 0) {
+			pthread_mutex_unlock(&edge_cache.mutex);
+			return 1;
+		}
+		pthread_mutex_unlock(&edge_cache.mutex);
+	}
+	pkey = X509_get0_pubkey(issuer);
+	if (pkey == NULL) {
+		return report_error(ctx, issuer, subject != issuer ? depth + 1 : depth, X509_V_ERR_UNABLE_TO_DECODE_ISSUER_PUBLIC_KEY);
+	}
+	if (X509_verify(subject, pkey) <= 0) {
+		return report_error(ctx, subject, depth, X509_V_ERR_CERT_SIGNATURE_FAILURE);
+	}
+	if (cacheable) {
+		pthread_mutex_lock(&edge_cache.mutex);
+		edge = &edge_cache.edges[hash & edge_cache.mask];
+		memcpy(edge->key, key, sizeof(key));
+		edge->expires = edge_expiry(subject, issuer);
+		pthread_mutex_unlock(&edge_cache.mutex);
+	}
+	return 1;
+}
+
+/* Checks a certificate's validity period against the verification time.
+ * Returns 0 if verification must stop */
+int check_time(X509_STORE_CTX* ctx, X509* cert, int depth) {
+	X509_VERIFY_PARAM* param;
+	time_t check_time;
+	time_t* ptime;
+	int cmp;
+	param = X509_STORE_CTX_get0_param(ctx);
+	if (X509_VERIFY_PARAM_get_flags(param) & X509_V_FLAG_NO_CHECK_TIME) {
+		return 1;
+	}
+	ptime = NULL;
+	if (X509_VERIFY_PARAM_get_flags(param) & X509_V_FLAG_USE_CHECK_TIME) {
+		check_time = X509_VERIFY_PARAM_get_time(param);
+		ptime = &check_time;
+	}
+	cmp = X509_cmp_time(X509_get0_notBefore(cert), ptime);
+	if (cmp == 0 && !report_error(ctx, cert, depth, X509_V_ERR_ERROR_IN_CERT_NOT_BEFORE_FIELD)) {
+		return 0;
+	}
+	if (cmp > 0 && !report_error(ctx, cert, depth, X509_V_ERR_CERT_NOT_YET_VALID)) {
+		return 0;
+	}
+	cmp = X509_cmp_time(X509_get0_notAfter(cert), ptime);
+	if (cmp == 0 && !report_error(ctx, cert, depth, X509_V_ERR_ERROR_IN_CERT_NOT_AFTER_FIELD)) {
+		return 0;
+	}
+	if (cmp < 0 && !report_error(ctx, cert, depth, X509_V_ERR_CERT_HAS_EXPIRED)) {
+		return 0;
+	}
+	return 1;
+}
+
+/* Records a verification error and lets the verify callback decide
+ * whether to carry on, like OpenSSL does */
+int report_error(X509_STORE_CTX* ctx, X509* cert, int depth, int error) {
+	X509_STORE_CTX_set_error_depth(ctx, depth);
+	X509_STORE_CTX_set_current_cert(ctx, cert);
+	X509_STORE_CTX_set_error(ctx, error);
+	return X509_STORE_CTX_get_verify_cb(ctx)(0, ctx);
+}
+
+/* Computes the cache key of a signature from both certificates'
+ * fingerprints, which interned certificates already know.  Returns 0 on
+ * failure */
+int edge_key(X509* subject, X509* issuer, unsigned char* key) {
+	unsigned char fingerprints[2 * CERT_DIGEST_LEN];
+	if (!cert_fingerprint(subject, fingerprints) || !cert_fingerprint(issuer, fingerprints + CERT_DIGEST_LEN)) {
+		return 0;
+	}
+	return EVP_Digest(fingerprints, sizeof(fingerprints), key, NULL, EVP_sha256(), NULL);
+}
+
+/* Returns when the earlier of two certificates expires, or 0 if that
+ * cannot be told */
+time_t edge_expiry(X509* subject, X509* issuer) {
+	const ASN1_TIME* not_after;
+	time_t expires;
+	int days;
+	int seconds;
+	not_after = ASN1_TIME_compare(X509_get0_notAfter(subject), X509_get0_notAfter(issuer)) < 0 ? X509_get0_notAfter(subject) : X509_get0_notAfter(issuer);
+	if (ASN1_TIME_diff(&days, &seconds, NULL, not_after) == 0) {
+		return 0;
+	}
+	expires = time(NULL) + (time_t)days * 86400 + seconds;
+	return expires;
+}
+
 /** returns a STACK_OF(X509)* from a pem file containing certificates
  *
  */
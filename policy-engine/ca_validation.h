@@ -1,10 +1,16 @@
 #ifndef CHECK_ROOT_STORE_H
 #define CHECK_ROOT_STORE_H
 
+#include <stddef.h>
 #include <openssl/x509.h>
 
 X509_STORE* make_new_root_store(void);
+char* default_root_store_path(void);
+X509_STORE* load_root_store(const char* path);
 int query_store(const char* hostname, STACK_OF(X509)* chain, X509_STORE* root_store);
 STACK_OF(X509)* pem_to_stack(char*);
+int edge_cache_init(size_t size);
+void edge_cache_flush(void);
+void edge_cache_free(void);
 
 #endif //CHECK_ROOT_STORE_H
@@ -0,0 +1,272 @@
+/*
+ * Interning of parsed certificates.
+ *
+ * Most chains repeat a few popular intermediates, so instead of parsing
+ * every certificate of every query, parsed certificates are kept in a
+ * table keyed by the SHA-256 of their DER encoding and shared by all the
+ * queries presenting them.  An entry counts the queries using it.  Once
+ * unused it moves to an idle list and stays parsed until the list grows
+ * past its capacity, when the least recently used entries are freed.
+ *
+ * Shared certificates must be treated as read only, which is all OpenSSL
+ * verification and the plugins need.  A certificate from cert_intern is
+ * given back with cert_release rather than X509_free.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+#include "tb_logging.h"
+#include "cert_intern.h"
+
+typedef struct cert_entry_t {
+	struct cert_entry_t* hash_next;
+	struct cert_entry_t* idle_prev;
+	struct cert_entry_t* idle_next;
+	unsigned char digest[CERT_DIGEST_LEN];
+	X509* cert; /* the table's reference */
+	int users;
+} cert_entry_t;
+
+static struct {
+	pthread_mutex_t mutex;
+	cert_entry_t** buckets;
+	size_t mask;
+	cert_entry_t* idle_head; /* most recently released */
+	cert_entry_t* idle_tail;
+	size_t idle_count;
+	size_t idle_capacity;
+	int ex_index; /* where a certificate keeps its entry */
+} interned = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, NULL, 0, 0, -1 };
+
+static cert_entry_t** find_slot(const unsigned char* digest);
+static void idle_unlink(cert_entry_t* entry);
+static void idle_push(cert_entry_t* entry);
+static void remove_entry(cert_entry_t* entry);
+static int digest_der(const unsigned char* der, size_t len, unsigned char* digest);
+
+/**
+ * Enables interning
+ * @param idle_capacity how many unused certificates stay parsed, 0 leaves
+ * interning disabled
+ * @returns 0 on success, 1 on failure
+ */
+int cert_intern_init(size_t idle_capacity) {
+	size_t buckets;
+	if (idle_capacity == 0) {
+		return 0;
+	}
+	buckets = 2;
+	while (buckets < idle_capacity * 2) {
+		buckets <<= 1;
+	}
+	interned.ex_index = X509_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	if (interned.ex_index < 0) {
+		tblog(LOG_ERROR, "Failed to reserve certificate data for interning");
+		return 1;
+	}
+	interned.buckets = (cert_entry_t**)calloc(buckets, sizeof(cert_entry_t*));
+	if (interned.buckets == NULL) {
+		tblog(LOG_ERROR, "Failed to allocate %zu buckets for interned certificates", buckets);
+		return 1;
+	}
+	interned.mask = buckets - 1;
+	interned.idle_capacity = idle_capacity;
+	return 0;
+}
+
+/**
+ * Frees every unused certificate and disables interning.  Certificates
+ * still in use are freed when they are released.
+ */
+void cert_intern_drain(void) {
+	pthread_mutex_lock(&interned.mutex);
+	while (interned.idle_tail != NULL) {
+		remove_entry(interned.idle_tail);
+	}
+	interned.idle_capacity = 0;
+	pthread_mutex_unlock(&interned.mutex);
+	return;
+}
+
+/**
+ * Parses a DER encoded certificate, or shares the one already parsed from
+ * the same encoding
+ * @returns the certificate, to be given back with cert_release, or NULL
+ * if it cannot be parsed
+ */
+X509* cert_intern(const unsigned char* der, size_t len) {
+	unsigned char digest[CERT_DIGEST_LEN];
+	cert_entry_t** slot;
+	cert_entry_t* entry;
+	const unsigned char* ptr;
+	X509* cert;
+	if (interned.buckets == NULL || digest_der(der, len, digest) == 0) {
+		ptr = der;
+		return d2i_X509(NULL, &ptr, len);
+	}
+	pthread_mutex_lock(&interned.mutex);
+	entry = *find_slot(digest);
+	if (entry != NULL) {
+		if (entry->users++ == 0) {
+			idle_unlink(entry);
+		}
+		X509_up_ref(entry->cert);
+		pthread_mutex_unlock(&interned.mutex);
+		return entry->cert;
+	}
+	pthread_mutex_unlock(&interned.mutex);
+
+	/* Parse outside the lock, a racing query may parse it too */
+	ptr = der;
+	cert = d2i_X509(NULL, &ptr, len);
+	if (cert == NULL) {
+		return NULL;
+	}
+	entry = (cert_entry_t*)malloc(sizeof(cert_entry_t));
+	if (entry == NULL) {
+		tblog(LOG_WARNING, "Could not allocate interned certificate");
+		return cert;
+	}
+	memcpy(entry->digest, digest, CERT_DIGEST_LEN);
+	entry->cert = cert;
+	entry->users = 1;
+	entry->idle_prev = NULL;
+	entry->idle_next = NULL;
+	entry->hash_next = NULL;
+	X509_set_ex_data(cert, interned.ex_index, entry);
+
+	pthread_mutex_lock(&interned.mutex);
+	slot = find_slot(digest);
+	if (*slot != NULL) {
+		/* Lost the race, use the winner's */
+		if ((*slot)->users++ == 0) {
+			idle_unlink(*slot);
+		}
+		X509_up_ref((*slot)->cert);
+		cert = (*slot)->cert;
+		pthread_mutex_unlock(&interned.mutex);
+		X509_free(entry->cert);
+		free(entry);
+		return cert;
+	}
+	*slot = entry;
+	/* One reference for the table and one for the caller */
+	X509_up_ref(cert);
+	pthread_mutex_unlock(&interned.mutex);
+	return cert;
+}
+
+/**
+ * Gives back a certificate obtained from cert_intern.  Usable as the
+ * free function of sk_X509_pop_free.
+ */
+void cert_release(X509* cert) {
+	cert_entry_t* entry;
+	if (cert == NULL) {
+		return;
+	}
+	entry = interned.ex_index >= 0 ? (cert_entry_t*)X509_get_ex_data(cert, interned.ex_index) : NULL;
+	if (entry != NULL) {
+		pthread_mutex_lock(&interned.mutex);
+		if (--entry->users == 0) {
+			idle_push(entry);
+			while (interned.idle_count > interned.idle_capacity) {
+				remove_entry(interned.idle_tail);
+			}
+		}
+		pthread_mutex_unlock(&interned.mutex);
+	}
+	X509_free(cert);
+	return;
+}
+
+/**
+ * Gets the SHA-256 of a certificate's DER encoding, which interned
+ * certificates have at hand
+ * @param digest buffer of CERT_DIGEST_LEN bytes
+ * @returns 1 on success, 0 on failure
+ */
+int cert_fingerprint(X509* cert, unsigned char* digest) {
+	cert_entry_t* entry;
+	unsigned char* der;
+	int len;
+	int ok;
+	entry = interned.ex_index >= 0 ? (cert_entry_t*)X509_get_ex_data(cert, interned.ex_index) : NULL;
+	if (entry != NULL) {
+		memcpy(digest, entry->digest, CERT_DIGEST_LEN);
+		return 1;
+	}
+	der = NULL;
+	len = i2d_X509(cert, &der);
+	if (len <= 0) {
+		return 0;
+	}
+	ok = digest_der(der, len, digest);
+	OPENSSL_free(der);
+	return ok;
+}
+
+int digest_der(const unsigned char* der, size_t len, unsigned char* digest) {
+	return EVP_Digest(der, len, digest, NULL, EVP_sha256(), NULL);
+}
+
+/* Returns the link pointing at the entry for digest, or at the NULL
+ * ending its bucket.  Caller must hold the mutex */
+cert_entry_t** find_slot(const unsigned char* digest) {
+	cert_entry_t** slot;
+	size_t hash;
+	memcpy(&hash, digest, sizeof(hash));
+	slot = &interned.buckets[hash & interned.mask];
+	while (*slot != NULL && memcmp((*slot)->digest, digest, CERT_DIGEST_LEN) != 0) {
+		slot = &(*slot)->hash_next;
+	}
+	return slot;
+}
+
+/* Frees an unused entry.  Caller must hold the mutex */
+void remove_entry(cert_entry_t* entry) {
+	cert_entry_t** slot;
+	slot = find_slot(entry->digest);
+	*slot = entry->hash_next;
+	idle_unlink(entry);
+	/* A plugin may still hold its own reference to the certificate */
+	X509_set_ex_data(entry->cert, interned.ex_index, NULL);
+	X509_free(entry->cert);
+	free(entry);
+	return;
+}
+
+void idle_unlink(cert_entry_t* entry) {
+	if (entry->idle_prev != NULL) {
+		entry->idle_prev->idle_next = entry->idle_next;
+	}
+	else {
+		interned.idle_head = entry->idle_next;
+	}
+	if (entry->idle_next != NULL) {
+		entry->idle_next->idle_prev = entry->idle_prev;
+	}
+	else {
+		interned.idle_tail = entry->idle_prev;
+	}
+	entry->idle_prev = NULL;
+	entry->idle_next = NULL;
+	interned.idle_count--;
+	return;
+}
+
+void idle_push(cert_entry_t* entry) {
+	entry->idle_prev = NULL;
+	entry->idle_next = interned.idle_head;
+	if (interned.idle_head != NULL) {
+		interned.idle_head->idle_prev = entry;
+	}
+	else {
+		interned.idle_tail = entry;
+	}
+	interned.idle_head = entry;
+	interned.idle_count++;
+	return;
+}
@@ -0,0 +1,17 @@
+#ifndef _CERT_INTERN_H
+#define _CERT_INTERN_H
+
+#include <stddef.h>
+#include <openssl/x509.h>
+#include <openssl/sha.h>
+
+#define CERT_DIGEST_LEN		SHA256_DIGEST_LENGTH
+#define DEFAULT_CERT_INTERN_SIZE	4096
+
+int cert_intern_init(size_t idle_capacity);
+void cert_intern_drain(void);
+X509* cert_intern(const unsigned char* der, size_t len);
+void cert_release(X509* cert);
+int cert_fingerprint(X509* cert, unsigned char* digest);
+
+#endif
@@ -14,6 +14,9 @@
 static int parse_plugin(config_setting_t* plugin_data, plugin_t* plugin, char* root_path);
 static int parse_addon(config_setting_t* plugin_data, addon_t* addon, char* root_path);
 static int parse_aggregation(config_setting_t* aggregation_data, policy_context_t* policy_context);
+static int parse_conditions(config_setting_t* plugin_data, plugin_t* plugins, int plugin_count, int plugin_id);
+static int parse_condition_list(config_setting_t* setting, plugin_t* plugins, int plugin_count, int plugin_id, plugin_condition_t** conditions, int* count);
+static int condition_reaches(plugin_t* plugins, int from, int target, unsigned char* visited);
 static int get_plugin_id(plugin_t* plugins, int plugin_count, const char* plugin_name);
 static char* copy_string(const char* original);
 static char* cat_path(char* a, const char* b);
@@ -27,7 +30,15 @@ int load_config(policy_context_t* policy_context, char* path, char* username) {
 	int i;
 	int plugin_count;
 	int addon_count;
+	int queue_capacity;
+	int cache_size;
+	int cache_ttl;
+	int edge_cache_size;
+	int intern_size;
+	int metrics_interval;
 	const char* config_username;
+	const char* queue_overflow;
+	const char* root_store;
 
 	plugin_count = 0;
 	addon_count = 0;
@@ -77,6 +88,11 @@ int load_config(policy_context_t* policy_context, char* path, char* username) {
 	}
 	policy_context->plugins = plugins;
 	policy_context->plugin_count = plugin_count;
+	/* Conditions name other plugins, so they are read once all exist */
+	for (i = 0; i < plugin_count; i++) {
+		cfg_data = config_setting_get_elem(setting, i);
+		parse_conditions(cfg_data, plugins, plugin_count, i);
+	}
 
 	// Aggregation parsing
 	setting = config_lookup(&cfg, "aggregation");
@@ -102,8 +118,139 @@ int load_config(policy_context_t* policy_context, char* path, char* username) {
 			username[0] = '\0';
 		}
 	}
+
+	// CA validation thread count parsing (optional), decider_threads
+	// is its older name
+	setting = config_lookup(&cfg, "ca_workers");
+	if (setting == NULL) {
+		setting = config_lookup(&cfg, "decider_threads");
+	}
+	if (setting != NULL) {
+		if (config_setting_type(setting) == CONFIG_TYPE_STRING && strncmp(config_setting_get_string(setting), "auto", sizeof("auto")) == 0) {
+			policy_context->ca_worker_count = CA_WORKERS_AUTO;
+		}
+		else if (config_setting_type(setting) == CONFIG_TYPE_INT && config_setting_get_int(setting) > 0) {
+			policy_context->ca_worker_count = config_setting_get_int(setting);
+		}
+		else {
+			tblog(LOG_ERROR, "ca_workers must be a positive number or \"auto\", using one per CPU");
+		}
+	}
+
+	// Netlink worker thread count parsing (optional)
+	setting = config_lookup(&cfg, "receive_workers");
+	if (setting != NULL) {
+		if (config_setting_type(setting) == CONFIG_TYPE_STRING && strncmp(config_setting_get_string(setting), "auto", sizeof("auto")) == 0) {
+			policy_context->receive_worker_count = RECEIVE_WORKERS_AUTO;
+		}
+		else if (config_setting_type(setting) == CONFIG_TYPE_INT && config_setting_get_int(setting) > 0) {
+			policy_context->receive_worker_count = config_setting_get_int(setting);
+		}
+		else {
+			tblog(LOG_ERROR, "receive_workers must be a positive number or \"auto\", using %d", policy_context->receive_worker_count);
+		}
+	}
+
+	// Netlink socket buffer parsing (optional)
+	setting = config_lookup(&cfg, "netlink_buffer_size");
+	if (setting != NULL) {
+		if (config_setting_get_int(setting) > 0) {
+			policy_context->netlink_buffer_size = config_setting_get_int(setting);
+		}
+		else {
+			tblog(LOG_ERROR, "netlink_buffer_size must be positive, using %d", policy_context->netlink_buffer_size);
+		}
+	}
+
+	// Queue sizing parsing (optional)
+	setting = config_lookup(&cfg, "queue_capacity");
+	if (setting != NULL) {
+		queue_capacity = config_setting_get_int(setting);
+		if (queue_capacity > 0) {
+			policy_context->queue_capacity = queue_capacity;
+		} else {
+			tblog(LOG_ERROR, "queue_capacity must be positive, using %d", policy_context->queue_capacity);
+		}
+	}
+	setting = config_lookup(&cfg, "queue_overflow");
+	if (setting != NULL) {
+		queue_overflow = config_setting_get_string(setting);
+		if (queue_overflow != NULL && strncmp(queue_overflow, "block", sizeof("block")) == 0) {
+			policy_context->queue_overflow = QUEUE_OVERFLOW_BLOCK;
+		}
+		else if (queue_overflow != NULL && strncmp(queue_overflow, "drop", sizeof("drop")) == 0) {
+			policy_context->queue_overflow = QUEUE_OVERFLOW_DROP;
+		}
+		else {
+			tblog(LOG_ERROR, "Unknown queue_overflow policy in configuration file");
+		}
+	}
+
+	// Verdict cache parsing (optional)
+	setting = config_lookup(&cfg, "verdict_cache_size");
+	if (setting != NULL) {
+		cache_size = config_setting_get_int(setting);
+		if (cache_size >= 0) {
+			policy_context->cache_size = cache_size;
+		} else {
+			tblog(LOG_ERROR, "verdict_cache_size must not be negative, using %d", policy_context->cache_size);
+		}
+	}
+	setting = config_lookup(&cfg, "verdict_cache_ttl");
+	if (setting != NULL) {
+		cache_ttl = config_setting_get_int(setting);
+		if (cache_ttl > 0) {
+			policy_context->cache_ttl = cache_ttl;
+		} else {
+			tblog(LOG_ERROR, "verdict_cache_ttl must be positive, using %d", policy_context->cache_ttl);
+		}
+	}
 		
 
+	// Verified edge cache sizing (optional)
+	setting = config_lookup(&cfg, "ca_edge_cache_size");
+	if (setting != NULL) {
+		edge_cache_size = config_setting_get_int(setting);
+		if (edge_cache_size >= 0) {
+			policy_context->edge_cache_size = edge_cache_size;
+		} else {
+			tblog(LOG_ERROR, "ca_edge_cache_size must not be negative, using %d", policy_context->edge_cache_size);
+		}
+	}
+
+	// Certificate interning sizing (optional)
+	setting = config_lookup(&cfg, "cert_intern_size");
+	if (setting != NULL) {
+		intern_size = config_setting_get_int(setting);
+		if (intern_size >= 0) {
+			policy_context->intern_size = intern_size;
+		} else {
+			tblog(LOG_ERROR, "cert_intern_size must not be negative, using %d", policy_context->intern_size);
+		}
+	}
+
+	// Root store parsing (optional), guessed from the distribution if absent
+	setting = config_lookup(&cfg, "root_store");
+	if (setting != NULL) {
+		root_store = config_setting_get_string(setting);
+		if (root_store != NULL) {
+			policy_context->root_store_path = copy_string(root_store);
+		} else {
+			tblog(LOG_ERROR, "root_store must be the path of a CA bundle");
+		}
+	}
+
+	// Metrics interval parsing (optional)
+	setting = config_lookup(&cfg, "metrics_interval");
+	if (setting != NULL) {
+		metrics_interval = config_setting_get_int(setting);
+		if (metrics_interval >= 0) {
+			policy_context->metrics_interval = metrics_interval;
+		} else {
+			tblog(LOG_ERROR, "metrics_interval must not be negative, using %d", policy_context->metrics_interval);
+		}
+	}
+
 	// Free up config data
 	config_destroy(&cfg);
 
@@ -166,6 +313,137 @@ int parse_aggregation(config_setting_t* aggregation_data, policy_context_t* poli
 	return 0;
 }
 
+/**
+ * Reads a plugin's optional run_if and skip_if settings.  Conditions that
+ * cannot be met in order, because they name a later tier or form a cycle,
+ * are dropped so the plugin runs unconditionally.
+ */
+int parse_conditions(config_setting_t* plugin_data, plugin_t* plugins, int plugin_count, int plugin_id) {
+	plugin_t* plugin;
+	plugin = &plugins[plugin_id];
+	if (parse_condition_list(config_setting_get_member(plugin_data, "run_if"), plugins, plugin_count, plugin_id, &plugin->run_if, &plugin->run_if_count) != 0 ||
+	    parse_condition_list(config_setting_get_member(plugin_data, "skip_if"), plugins, plugin_count, plugin_id, &plugin->skip_if, &plugin->skip_if_count) != 0) {
+		tblog(LOG_ERROR, "Ignoring the conditions of plugin %s", plugin->name);
+		free(plugin->run_if);
+		free(plugin->skip_if);
+		plugin->run_if = NULL;
+		plugin->skip_if = NULL;
+		plugin->run_if_count = 0;
+		plugin->skip_if_count = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Parses a single "<plugin name or CA>:<valid or invalid>" string or a
+ * list of them
+ * @returns 0 on success, 1 if any condition is malformed or unsatisfiable
+ */
+int parse_condition_list(config_setting_t* setting, plugin_t* plugins, int plugin_count, int plugin_id, plugin_condition_t** conditions, int* count) {
+	const char* condition;
+	const char* separator;
+	unsigned char* visited;
+	size_t source_len;
+	int length;
+	int i;
+	int j;
+	*conditions = NULL;
+	*count = 0;
+	if (setting == NULL) {
+		return 0;
+	}
+	length = config_setting_type(setting) == CONFIG_TYPE_STRING ? 1 : config_setting_length(setting);
+	*conditions = (plugin_condition_t*)calloc(length, sizeof(plugin_condition_t));
+	if (*conditions == NULL) {
+		tblog(LOG_ERROR, "Failed to allocate plugin conditions");
+		return 1;
+	}
+	for (i = 0; i < length; i++) {
+		if (config_setting_type(setting) == CONFIG_TYPE_STRING) {
+			condition = config_setting_get_string(setting);
+		}
+		else {
+			condition = config_setting_get_string_elem(setting, i);
+		}
+		separator = condition != NULL ? strrchr(condition, ':') : NULL;
+		if (separator == NULL) {
+			tblog(LOG_ERROR, "Plugin conditions must look like \"<plugin or CA>:<valid or invalid>\"");
+			return 1;
+		}
+		if (strncmp(separator + 1, "valid", sizeof("valid")) == 0) {
+			(*conditions)[i].response = PLUGIN_RESPONSE_VALID;
+		}
+		else if (strncmp(separator + 1, "invalid", sizeof("invalid")) == 0) {
+			(*conditions)[i].response = PLUGIN_RESPONSE_INVALID;
+		}
+		else {
+			tblog(LOG_ERROR, "Unknown response in plugin condition %s", condition);
+			return 1;
+		}
+		source_len = separator - condition;
+		if (source_len == strlen("CA") && strncmp(condition, "CA", source_len) == 0) {
+			(*conditions)[i].source = CONDITION_SOURCE_CA;
+			(*count)++;
+			continue;
+		}
+		for (j = 0; j < plugin_count; j++) {
+			if (plugins[j].name != NULL && strlen(plugins[j].name) == source_len && strncmp(plugins[j].name, condition, source_len) == 0) {
+				break;
+			}
+		}
+		if (j == plugin_count) {
+			tblog(LOG_ERROR, "Plugin condition %s names a plugin that does not exist", condition);
+			return 1;
+		}
+		/* A plugin is dispatched after the plugins it depends on, so
+		 * those may not be in a later tier or wait on it in turn */
+		if (plugins[j].tier > plugins[plugin_id].tier) {
+			tblog(LOG_ERROR, "Plugin condition %s names a plugin in a later tier", condition);
+			return 1;
+		}
+		(*conditions)[i].source = j;
+		(*count)++;
+		visited = (unsigned char*)calloc(plugin_count, 1);
+		if (visited == NULL) {
+			tblog(LOG_ERROR, "Failed to allocate plugin conditions");
+			return 1;
+		}
+		if (condition_reaches(plugins, j, plugin_id, visited)) {
+			free(visited);
+			tblog(LOG_ERROR, "Plugin condition %s depends on itself", condition);
+			return 1;
+		}
+		free(visited);
+	}
+	return 0;
+}
+
+/* Whether the conditions of plugin from, followed transitively, depend
+ * on plugin target.  Only conditions parsed so far are followed, which is
+ * enough since a cycle is caught when its last link is added */
+int condition_reaches(plugin_t* plugins, int from, int target, unsigned char* visited) {
+	int i;
+	if (from == target) {
+		return 1;
+	}
+	if (visited[from]) {
+		return 0;
+	}
+	visited[from] = 1;
+	for (i = 0; i < plugins[from].run_if_count; i++) {
+		if (plugins[from].run_if[i].source != CONDITION_SOURCE_CA && condition_reaches(plugins, plugins[from].run_if[i].source, target, visited)) {
+			return 1;
+		}
+	}
+	for (i = 0; i < plugins[from].skip_if_count; i++) {
+		if (plugins[from].skip_if[i].source != CONDITION_SOURCE_CA && condition_reaches(plugins, plugins[from].skip_if[i].source, target, visited)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
 int get_plugin_id(plugin_t* plugins, int plugin_count, const char* plugin_name) {
 	int i;
 	for (i = 0; i < plugin_count; i++) {
@@ -209,6 +487,13 @@ int parse_plugin(config_setting_t* plugin_data, plugin_t* plugin, char* root_pat
 	const char* abstain_map;
 	const char* error_map;
 	int openSSL;
+	int cache;
+	int timeout;
+	double adaptive_percentile;
+	config_setting_t* workers;
+	int breaker_threshold;
+	int breaker_cooldown;
+	int tier;
 	const char* path;
 	if (!(config_setting_lookup_string(plugin_data, "name", &name) &&
 	    config_setting_lookup_string(plugin_data, "description", &desc) &&
@@ -223,6 +508,66 @@ int parse_plugin(config_setting_t* plugin_data, plugin_t* plugin, char* root_pat
 	}
 
 	plugin->aggregation = AGGREGATION_NONE;
+	/* Plugins may opt out of the verdict cache, e.g. if their answer
+	 * depends on more than the hostname and certificate chain.  What an
+	 * addon's plugin looks at cannot be known, so those must opt in */
+	plugin->cacheable = strncmp(handler, "native", sizeof("native")) == 0;
+	if (config_setting_lookup_int(plugin_data, "cache", &cache)) {
+		plugin->cacheable = cache != 0;
+	}
+	plugin->timeout = DEFAULT_PLUGIN_TIMEOUT;
+	if (config_setting_lookup_int(plugin_data, "timeout", &timeout)) {
+		if (timeout > 0) {
+			plugin->timeout = timeout;
+		}
+		else {
+			tblog(LOG_ERROR, "Plugin timeout must be positive, using %d ms", plugin->timeout);
+		}
+	}
+	plugin->adaptive_percentile = 0;
+	if (config_setting_lookup_float(plugin_data, "adaptive_timeout", &adaptive_percentile)) {
+		if (adaptive_percentile > 0 && adaptive_percentile <= 1) {
+			plugin->adaptive_percentile = adaptive_percentile;
+		}
+		else {
+			tblog(LOG_ERROR, "Plugin adaptive_timeout must be a percentile between 0 and 1");
+		}
+	}
+	plugin->deadline = plugin->timeout;
+	latency_init(&plugin->latency);
+	plugin->workers = 1;
+	workers = config_setting_get_member(plugin_data, "workers");
+	if (workers != NULL) {
+		if (config_setting_type(workers) == CONFIG_TYPE_STRING && strncmp(config_setting_get_string(workers), "auto", sizeof("auto")) == 0) {
+			plugin->workers = PLUGIN_WORKERS_AUTO;
+		}
+		else if (config_setting_type(workers) == CONFIG_TYPE_INT && config_setting_get_int(workers) > 0) {
+			plugin->workers = config_setting_get_int(workers);
+		}
+		else {
+			tblog(LOG_ERROR, "Plugin workers must be a positive number or \"auto\", using 1");
+		}
+	}
+	breaker_threshold = DEFAULT_BREAKER_THRESHOLD;
+	if (config_setting_lookup_int(plugin_data, "breaker_threshold", &breaker_threshold) && breaker_threshold < 0) {
+		tblog(LOG_ERROR, "Plugin breaker_threshold must not be negative, using %d", DEFAULT_BREAKER_THRESHOLD);
+		breaker_threshold = DEFAULT_BREAKER_THRESHOLD;
+	}
+	breaker_cooldown = DEFAULT_BREAKER_COOLDOWN;
+	if (config_setting_lookup_int(plugin_data, "breaker_cooldown", &breaker_cooldown) && breaker_cooldown <= 0) {
+		tblog(LOG_ERROR, "Plugin breaker_cooldown must be positive, using %d ms", DEFAULT_BREAKER_COOLDOWN);
+		breaker_cooldown = DEFAULT_BREAKER_COOLDOWN;
+	}
+	breaker_init(&plugin->breaker, breaker_threshold, breaker_cooldown);
+	plugin->tier = 0;
+	if (config_setting_lookup_int(plugin_data, "tier", &tier)) {
+		if (tier >= 0) {
+			plugin->tier = tier;
+		}
+		else {
+			tblog(LOG_ERROR, "Plugin tier must not be negative, using 0");
+		}
+	}
 	if (strncmp(abstain_map, "invalid", sizeof("invalid")) == 0) {
 		plugin->abstain_map = PLUGIN_RESPONSE_INVALID;
 	}
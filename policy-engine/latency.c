@@ -0,0 +1,102 @@
+#include <string.h>
+#include "latency.h"
+
+static int bucket_of(unsigned int ms);
+static unsigned int bucket_limit(int bucket);
+
+/**
+ * Empties a histogram
+ */
+void latency_init(latency_histogram_t* histogram) {
+	memset(histogram, 0, sizeof(latency_histogram_t));
+	return;
+}
+
+/**
+ * Adds a sample to the histogram
+ * @returns the number of samples in the histogram, including this one
+ */
+uint32_t latency_record(latency_histogram_t* histogram, unsigned int ms) {
+	__atomic_add_fetch(&histogram->counts[bucket_of(ms)], 1, __ATOMIC_RELAXED);
+	return __atomic_add_fetch(&histogram->total, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Estimates a percentile of the recorded samples
+ * @param percentile between 0 and 1
+ * @returns upper bound in milliseconds of the bucket holding the
+ * percentile, or 0 if there are no samples
+ */
+unsigned int latency_percentile(latency_histogram_t* histogram, double percentile) {
+	uint32_t counts[LATENCY_BUCKETS];
+	uint64_t total;
+	uint64_t seen;
+	uint64_t rank;
+	int i;
+	total = 0;
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		counts[i] = __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+		total += counts[i];
+	}
+	if (total == 0) {
+		return 0;
+	}
+	rank = (uint64_t)(percentile * total + 0.5);
+	if (rank == 0) {
+		rank = 1;
+	}
+	seen = 0;
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += counts[i];
+		if (seen >= rank) {
+			break;
+		}
+	}
+	return bucket_limit(i < LATENCY_BUCKETS ? i : LATENCY_BUCKETS - 1);
+}
+
+/**
+ * Halves every count so that old samples weigh less than new ones.
+ * Samples recorded concurrently are not lost.
+ */
+void latency_decay(latency_histogram_t* histogram) {
+	uint32_t count;
+	uint32_t removed;
+	int i;
+	removed = 0;
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		count = __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&histogram->counts[i], count / 2, __ATOMIC_RELAXED);
+		removed += count / 2;
+	}
+	__atomic_sub_fetch(&histogram->total, removed, __ATOMIC_RELAXED);
+	return;
+}
+
+/* Buckets 0 to 3 hold 0-3 ms exactly, after that each power of two
+ * [2^e, 2^(e+1)) is split into four equal parts */
+int bucket_of(unsigned int ms) {
+	int exponent;
+	int bucket;
+	if (ms < (1 << LATENCY_SUB_BITS)) {
+		return ms;
+	}
+	exponent = 31 - __builtin_clz(ms);
+	bucket = ((exponent - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + ((ms >> (exponent - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1));
+	if (bucket >= LATENCY_BUCKETS) {
+		bucket = LATENCY_BUCKETS - 1;
+	}
+	return bucket;
+}
+
+/* Largest value that falls into a bucket */
+unsigned int bucket_limit(int bucket) {
+	int exponent;
+	int sub;
+	if (bucket < (1 << LATENCY_SUB_BITS)) {
+		return bucket;
+	}
+	exponent = (bucket >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+	sub = bucket & ((1 << LATENCY_SUB_BITS) - 1);
+	return (1U << exponent) + ((sub + 1U) << (exponent - LATENCY_SUB_BITS)) - 1;
+}
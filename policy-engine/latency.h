@@ -0,0 +1,22 @@
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+#include <stdint.h>
+
+#define LATENCY_SUB_BITS	2
+#define LATENCY_BUCKETS		(17 << LATENCY_SUB_BITS)
+
+/* Log-linear histogram of response times in milliseconds.  Each power of
+ * two is split into 1 << LATENCY_SUB_BITS buckets, so a percentile read
+ * from it is within 25% of the true value.  Updates are lock-free */
+typedef struct latency_histogram_t {
+	uint32_t counts[LATENCY_BUCKETS];
+	uint32_t total;
+} latency_histogram_t;
+
+void latency_init(latency_histogram_t* histogram);
+uint32_t latency_record(latency_histogram_t* histogram, unsigned int ms);
+unsigned int latency_percentile(latency_histogram_t* histogram, double percentile);
+void latency_decay(latency_histogram_t* histogram);
+
+#endif
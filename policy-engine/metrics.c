@@ -0,0 +1,50 @@
+#include <unistd.h>
+#include <pthread.h>
+#include "policy_engine.h"
+#include "tb_logging.h"
+#include "metrics.h"
+
+engine_metrics_t metrics;
+
+/**
+ * Writes the engine counters and every plugin's state to the log
+ */
+void metrics_log(policy_context_t* context) {
+	plugin_t* plugin;
+	unsigned int trips;
+	int state;
+	int i;
+	tblog(LOG_INFO, "Metrics: queries=%llu cache_hits=%llu coalesced=%llu plugin_timeouts=%llu plugin_reclaims=%llu breaker_skips=%llu condition_skips=%llu netlink_overruns=%llu netlink_truncated=%llu",
+		(unsigned long long)__atomic_load_n(&metrics.queries, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&metrics.cache_hits, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&metrics.coalesced, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&metrics.plugin_timeouts, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&metrics.plugin_reclaims, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&metrics.breaker_skips, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&metrics.condition_skips, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&metrics.netlink_overruns, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&metrics.netlink_truncated, __ATOMIC_RELAXED));
+	for (i = 0; i < context->plugin_count; i++) {
+		plugin = &context->plugins[i];
+		state = breaker_state(&plugin->breaker, &trips);
+		tblog(LOG_INFO, "Metrics: plugin \"%s\" breaker=%s trips=%u deadline=%dms",
+			plugin->name, breaker_state_name(state), trips,
+			__atomic_load_n(&plugin->deadline, __ATOMIC_RELAXED));
+	}
+	return;
+}
+
+/**
+ * Thread body that logs the metrics every metrics_interval seconds
+ * @param arg the policy_context_t
+ */
+void* metrics_run(void* arg) {
+	policy_context_t* context;
+	context = (policy_context_t*)arg;
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	while (1) {
+		sleep(context->metrics_interval);
+		metrics_log(context);
+	}
+	return NULL;
+}
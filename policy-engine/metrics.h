@@ -0,0 +1,30 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdint.h>
+
+#define DEFAULT_METRICS_INTERVAL	60 // in seconds
+
+/* Engine-wide counters, reported periodically by metrics_run */
+typedef struct engine_metrics_t {
+	uint64_t queries;
+	uint64_t cache_hits;
+	uint64_t coalesced;
+	uint64_t plugin_timeouts;
+	uint64_t plugin_reclaims;
+	uint64_t breaker_skips;
+	uint64_t condition_skips;
+	uint64_t netlink_overruns;
+	uint64_t netlink_truncated;
+} engine_metrics_t;
+
+extern engine_metrics_t metrics;
+
+#define METRIC_INC(name)	__atomic_add_fetch(&metrics.name, 1, __ATOMIC_RELAXED)
+
+struct policy_context_t;
+
+void metrics_log(struct policy_context_t* context);
+void* metrics_run(void* arg);
+
+#endif
@@ -1,12 +1,54 @@
+#define _GNU_SOURCE /* recvmmsg */
 #include <netlink/genl/genl.h>
 #include <netlink/genl/ctrl.h>
 #include <signal.h>
-#include <sqlite3.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "sni_parser.h"
 #include "policy_engine.h"
 #include "tb_logging.h"
 #include "tb_user.h"
 #include "netlink.h"
+#include "tls_pins.h"
+#include "metrics.h"
+#include "rx_buffer.h"
+#include "policy_response.h"
+
+/* Messages of one connection always go to the same worker, picked by
+ * their state pointer, and each worker handles its messages in order.  A
+ * message stays in the buffer it was received into */
+typedef struct rx_msg_t {
+	struct rx_msg_t* next;
+	rx_buffer_t* buffer; /* the message's reference */
+	struct nlmsghdr* nlh;
+} rx_msg_t;
+
+typedef struct rx_shard_t {
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	rx_msg_t* head;
+	rx_msg_t* tail;
+	int count;
+	int running;
+	pthread_t thread;
+} rx_shard_t;
+
+/* A verdict waiting for the sender, in a bounded multi-producer ring like
+ * query_queue.c's.  The sender is its only consumer */
+typedef struct tx_cell_t {
+	uint64_t sequence;
+	uint64_t stptr;
+	uint32_t spid;
+	int result;
+} tx_cell_t;
 
 static struct nla_policy tb_policy[TRUSTBASE_A_MAX + 1] = {
         [TRUSTBASE_A_CERTCHAIN] = { .type = NLA_UNSPEC },
@@ -21,53 +63,240 @@ static struct nla_policy tb_policy[TRUSTBASE_A_MAX + 1] = {
 
 static int family;
 struct nl_sock* netlink_sock;
-pthread_mutex_t nl_sock_mutex;
 static volatile int keep_running;
-sqlite3* db;
+static struct {
+	tx_cell_t* cells;
+	unsigned char* buffer; /* RESPONSE_BATCH messages */
+	uint64_t enqueue_pos __attribute__((aligned(64)));
+	uint64_t dequeue_pos __attribute__((aligned(64)));
+	int not_empty __attribute__((aligned(64))); /* futex word */
+	int sleeping;
+	int running;
+	uint32_t local_port;
+	pthread_t thread;
+} tx;
+static rx_shard_t* shards;
+static int shard_count;
 
 void int_handler(int signal);
+static void handle_message(struct nlmsghdr* nlh, rx_buffer_t* buffer);
+static int receive_failed(const char* call);
+static void receive_large(int fd, size_t size, rx_buffer_t* slot);
+static rx_buffer_t* unspill(rx_buffer_t* slot, unsigned char* spill, size_t len);
+static void reject_truncated(unsigned char* data, int len);
+static void route_datagram(rx_buffer_t* buffer);
+static void* shard_thread(void* arg);
+static int start_shards(int count);
+static void stop_shards(void);
+static int take_responses(tx_cell_t* out, int max);
+static void put_response(unsigned char* buf, tx_cell_t* response);
+static void* sender_thread(void* arg);
+static int start_sender(void);
+static void stop_sender(void);
 
+/**
+ * Queues a verdict for the kernel.  Never takes a lock; the sender thread
+ * transmits it along with whatever other verdicts are queued.
+ * @returns 0 on success, -1 if the sender is not running
+ */
 int send_response(uint32_t spid, uint64_t stptr, int result) {
-	int rc;
-	struct nl_msg* msg;
-	void* msg_head;
-	msg = nlmsg_alloc();
-	if (msg == NULL) {
-		tblog(LOG_WARNING, "failed to allocate message buffer");
+	tx_cell_t* cell;
+	uint64_t pos;
+	uint64_t seq;
+	int64_t dif;
+	if (!__atomic_load_n(&tx.running, __ATOMIC_ACQUIRE)) {
+		tblog(LOG_WARNING, "Response sender is not running, dropping verdict");
 		return -1;
 	}
-	msg_head = genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, 0, TRUSTBASE_C_RESPONSE, 1);
-	if (msg_head == NULL) {
-		tblog(LOG_WARNING, "failed in genlmsg_put");
-		return -1;
+	pos = __atomic_load_n(&tx.enqueue_pos, __ATOMIC_RELAXED);
+	while (1) {
+		cell = &tx.cells[pos & (RESPONSE_QUEUE_SIZE - 1)];
+		seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		dif = (int64_t)seq - (int64_t)pos;
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&tx.enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		}
+		else if (dif < 0) {
+			/* Full, the kernel waits on every verdict so it may not
+			 * be dropped */
+			sched_yield();
+			pos = __atomic_load_n(&tx.enqueue_pos, __ATOMIC_RELAXED);
+		}
+		else {
+			pos = __atomic_load_n(&tx.enqueue_pos, __ATOMIC_RELAXED);
+		}
 	}
-	rc = nla_put_u64(msg, TRUSTBASE_A_STATE_PTR, stptr);
-	if (rc != 0) {
-		tblog(LOG_WARNING, "failed to insert state pointer");
-		return -1;
+	cell->spid = spid;
+	cell->stptr = stptr;
+	cell->result = result;
+	__atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&tx.not_empty, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&tx.sleeping, __ATOMIC_SEQ_CST)) {
+		syscall(SYS_futex, &tx.not_empty, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+	return 0;
+}
+
+/* Takes up to max queued verdicts.  Only the sender thread dequeues */
+int take_responses(tx_cell_t* out, int max) {
+	tx_cell_t* cell;
+	int count;
+	for (count = 0; count < max; count++) {
+		cell = &tx.cells[tx.dequeue_pos & (RESPONSE_QUEUE_SIZE - 1)];
+		if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != tx.dequeue_pos + 1) {
+			break;
+		}
+		out[count] = *cell;
+		__atomic_store_n(&cell->sequence, tx.dequeue_pos + RESPONSE_QUEUE_SIZE, __ATOMIC_RELEASE);
+		tx.dequeue_pos++;
+	}
+	return count;
+}
+
+/* Writes one verdict message at buf, RESPONSE_MSG_LEN bytes */
+void put_response(unsigned char* buf, tx_cell_t* response) {
+	struct nlmsghdr* nlh;
+	struct genlmsghdr* gnlh;
+	struct nlattr* attr;
+	uint32_t result;
+	memset(buf, 0, RESPONSE_MSG_LEN);
+	nlh = (struct nlmsghdr*)buf;
+	nlh->nlmsg_len = RESPONSE_MSG_LEN;
+	nlh->nlmsg_type = family;
+	/* No NLM_F_ACK, nobody reads the acknowledgements */
+	nlh->nlmsg_flags = NLM_F_REQUEST;
+	nlh->nlmsg_pid = tx.local_port;
+	gnlh = (struct genlmsghdr*)nlmsg_data(nlh);
+	gnlh->cmd = TRUSTBASE_C_RESPONSE;
+	gnlh->version = 1;
+	attr = (struct nlattr*)((unsigned char*)gnlh + GENL_HDRLEN);
+	attr->nla_len = nla_attr_size(sizeof(uint64_t));
+	attr->nla_type = TRUSTBASE_A_STATE_PTR;
+	memcpy(nla_data(attr), &response->stptr, sizeof(uint64_t));
+	attr = (struct nlattr*)((unsigned char*)attr + nla_total_size(sizeof(uint64_t)));
+	attr->nla_len = nla_attr_size(sizeof(uint32_t));
+	attr->nla_type = TRUSTBASE_A_RESULT;
+	result = response->result;
+	memcpy(nla_data(attr), &result, sizeof(uint32_t));
+	return;
+}
+
+/* Sends queued verdicts until stopped.  Consecutive verdicts for the same
+ * peer share a datagram and each batch of datagrams is one sendmmsg */
+void* sender_thread(void* arg) {
+	tx_cell_t responses[RESPONSE_BATCH];
+	struct mmsghdr msgs[RESPONSE_BATCH];
+	struct iovec iovs[RESPONSE_BATCH];
+	struct sockaddr_nl peers[RESPONSE_BATCH];
+	unsigned char* buffer;
+	int fd;
+	int count;
+	int datagrams;
+	int sent;
+	int rc;
+	int word;
+	int i;
+	buffer = tx.buffer;
+	fd = nl_socket_get_fd(netlink_sock);
+	while (1) {
+		word = __atomic_load_n(&tx.not_empty, __ATOMIC_SEQ_CST);
+		count = take_responses(responses, RESPONSE_BATCH);
+		if (count == 0) {
+			if (!__atomic_load_n(&tx.running, __ATOMIC_ACQUIRE)) {
+				break;
+			}
+			/* Check again once registered, so a verdict queued in
+			 * between is not slept through */
+			__atomic_store_n(&tx.sleeping, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&tx.not_empty, __ATOMIC_SEQ_CST) == word) {
+				syscall(SYS_futex, &tx.not_empty, FUTEX_WAIT_PRIVATE, word, NULL, NULL, 0);
+			}
+			__atomic_store_n(&tx.sleeping, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		datagrams = 0;
+		for (i = 0; i < count; i++) {
+			put_response(buffer + (size_t)i * RESPONSE_MSG_LEN, &responses[i]);
+			if (datagrams > 0 && peers[datagrams - 1].nl_pid == responses[i].spid) {
+				iovs[datagrams - 1].iov_len += RESPONSE_MSG_LEN;
+				continue;
+			}
+			memset(&peers[datagrams], 0, sizeof(struct sockaddr_nl));
+			peers[datagrams].nl_family = AF_NETLINK;
+			peers[datagrams].nl_pid = responses[i].spid;
+			iovs[datagrams].iov_base = buffer + (size_t)i * RESPONSE_MSG_LEN;
+			iovs[datagrams].iov_len = RESPONSE_MSG_LEN;
+			memset(&msgs[datagrams].msg_hdr, 0, sizeof(struct msghdr));
+			msgs[datagrams].msg_hdr.msg_name = &peers[datagrams];
+			msgs[datagrams].msg_hdr.msg_namelen = sizeof(struct sockaddr_nl);
+			msgs[datagrams].msg_hdr.msg_iov = &iovs[datagrams];
+			msgs[datagrams].msg_hdr.msg_iovlen = 1;
+			datagrams++;
+		}
+		for (sent = 0; sent < datagrams; sent += rc) {
+			rc = sendmmsg(fd, msgs + sent, datagrams - sent, 0);
+			if (rc < 0) {
+				if (errno == EINTR) {
+					rc = 0;
+					continue;
+				}
+				/* Give up on this datagram only */
+				tblog(LOG_WARNING, "failed to send verdicts to %u, error %d", peers[sent].nl_pid, errno);
+				rc = 1;
+			}
+		}
 	}
-	rc = nla_put_u32(msg, TRUSTBASE_A_RESULT, result);
-	if (rc != 0) {
-		tblog(LOG_WARNING, "failed to insert result");
+	return NULL;
+}
+
+/* Starts the sender once the socket is connected */
+int start_sender(void) {
+	uint64_t i;
+	tx.cells = (tx_cell_t*)malloc(sizeof(tx_cell_t) * RESPONSE_QUEUE_SIZE);
+	tx.buffer = (unsigned char*)malloc((size_t)RESPONSE_BATCH * RESPONSE_MSG_LEN);
+	if (tx.cells == NULL || tx.buffer == NULL) {
+		tblog(LOG_ERROR, "Failed to allocate response queue");
+		free(tx.cells);
+		free(tx.buffer);
 		return -1;
 	}
-	pthread_mutex_lock(&nl_sock_mutex);
-	nl_socket_set_peer_port(netlink_sock, spid);
-	rc = nl_send_auto(netlink_sock, msg);
-	pthread_mutex_unlock(&nl_sock_mutex);
-	if (rc < 0) {
-		tblog(LOG_WARNING, "failed in nl send with error code %d", rc);
+	for (i = 0; i < RESPONSE_QUEUE_SIZE; i++) {
+		tx.cells[i].sequence = i;
+	}
+	tx.local_port = nl_socket_get_local_port(netlink_sock);
+	tx.running = 1;
+	if (pthread_create(&tx.thread, NULL, sender_thread, NULL) != 0) {
+		tblog(LOG_ERROR, "Failed to start response sender");
+		tx.running = 0;
 		return -1;
 	}
-	return 0;	
+	return 0;
+}
+
+/* Sends what is still queued and stops the sender.  Nothing may queue a
+ * verdict any more, see close_communication */
+void stop_sender(void) {
+	if (!tx.running) {
+		return;
+	}
+	__atomic_store_n(&tx.running, 0, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&tx.not_empty, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &tx.not_empty, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	pthread_join(tx.thread, NULL);
+	free(tx.cells);
+	free(tx.buffer);
+	tx.cells = NULL;
+	tx.buffer = NULL;
+	return;
 }
 
-int recv_query(struct nl_msg *msg, void *arg) {
-	struct nlmsghdr* nlh;
+/* Queries made from the message keep its buffer rather than copying
+ * their chain and hellos */
+void handle_message(struct nlmsghdr* nlh, rx_buffer_t* buffer) {
 	struct genlmsghdr* gnlh;
 	struct nlattr* attrs[TRUSTBASE_A_MAX + 1];
-	char query[256];
-	sqlite3_stmt* res;
 	char* hostname;
 	char* ip_str;
 	unsigned char* cert_chain;
@@ -83,7 +312,6 @@ int recv_query(struct nl_msg *msg, void *arg) {
 	ip_str = NULL;
 
 	// Get Message
-	nlh = nlmsg_hdr(msg);
 	gnlh = (struct genlmsghdr*)nlmsg_data(nlh);
 	genlmsg_parse(nlh, 0, attrs, TRUSTBASE_A_MAX, tb_policy);
 	switch (gnlh->cmd) {
@@ -99,7 +327,7 @@ int recv_query(struct nl_msg *msg, void *arg) {
 			server_hello_len = 0;
 			server_hello = NULL;
 			stptr = nla_get_u64(attrs[TRUSTBASE_A_STATE_PTR]);
-			poll_schemes(nlh->nlmsg_pid, stptr, hostname, port, cert_chain, chain_length, client_hello, client_hello_len, server_hello, server_hello_len);
+			poll_schemes(nlh->nlmsg_pid, stptr, hostname, port, cert_chain, chain_length, client_hello, client_hello_len, server_hello, server_hello_len, buffer);
 			break;
 		case TRUSTBASE_C_QUERY:
 			tblog(LOG_DEBUG, "Received a query from PID %u", nlh->nlmsg_pid);
@@ -116,39 +344,22 @@ int recv_query(struct nl_msg *msg, void *arg) {
 			hostname = sni_get_hostname(client_hello, client_hello_len);
 			ip_str = nla_get_string(attrs[TRUSTBASE_A_IP]);
 			/* Query registered schemes */
-			poll_schemes(nlh->nlmsg_pid, stptr, hostname, port, cert_chain, chain_length, client_hello, client_hello_len, server_hello, server_hello_len);
-			sprintf(query, "INSERT OR IGNORE INTO Pins VALUES ('%s', %d)", ip_str, port);
-			if (sqlite3_prepare_v2(db, query, 256, &res, 0) != SQLITE_OK) {
-				tblog(LOG_ERROR, "TLS Pin insert failed %s", sqlite3_errmsg(db));
-			} else {
-				sqlite3_step(res);
-				sqlite3_finalize(res);
-			}
-			// XXX I *think* the message is freed by whatever function calls this one
-			// within libnl.  Verify this.
+			poll_schemes(nlh->nlmsg_pid, stptr, hostname, port, cert_chain, chain_length, client_hello, client_hello_len, server_hello, server_hello_len, buffer);
+			/* Written to the database in the background */
+			tls_pins_add(ip_str, port);
 			break;
 		case TRUSTBASE_C_SHOULDTLS:
 			port = nla_get_u16(attrs[TRUSTBASE_A_PORTNUMBER]);
 			stptr = nla_get_u64(attrs[TRUSTBASE_A_STATE_PTR]);
 			ip_str = nla_get_string(attrs[TRUSTBASE_A_IP]);
-			sprintf(query, "SELECT COUNT(*) FROM Pins WHERE Hostname = '%s' AND Port = %d", ip_str, port);
-			if (sqlite3_prepare_v2(db, query, 256, &res, 0) != SQLITE_OK) {
-				tblog(LOG_ERROR, "Failed to lookup pin, %s", sqlite3_errmsg(db));
-			}
-			if (sqlite3_step(res) == SQLITE_ROW) {
-				if (sqlite3_column_int(res, 0) == 1) {
-					send_response(nlh->nlmsg_pid, stptr, 1);
-					tblog(LOG_DEBUG, "Pin found!");
-				}
-				else {
-					send_response(nlh->nlmsg_pid, stptr, 0);
-					tblog(LOG_DEBUG, "Pin not found");
-				}
+			if (tls_pins_contains(ip_str, port)) {
+				send_response(nlh->nlmsg_pid, stptr, 1);
+				tblog(LOG_DEBUG, "Pin found!");
 			}
 			else {
-				tblog(LOG_ERROR, "Failed to return a result");
+				send_response(nlh->nlmsg_pid, stptr, 0);
+				tblog(LOG_DEBUG, "Pin not found");
 			}
-			sqlite3_finalize(res);
 			break;
 		case TRUSTBASE_C_SHUTDOWN:
 			/* Receiving this will exit the listen_for_queries loop, as long as keep_running is set to 0 first */
@@ -158,32 +369,23 @@ int recv_query(struct nl_msg *msg, void *arg) {
 			tblog(LOG_DEBUG, "Got something unusual...");
 			break;
 	}
-	return 0;
+	return;
 }
 
-int prep_communication(const char* username) {
+/**
+ * Opens the netlink socket and joins the TrustBase query group
+ * @param buffer_size bytes the kernel may queue for us before it has to
+ * drop queries
+ */
+int prep_communication(const char* username, int buffer_size) {
 	int group;
-	char query[256];
-	sqlite3_stmt* res;
 	netlink_sock = nl_socket_alloc();
-	if (sqlite3_open("/var/log/tls_pinning.db", &db) != SQLITE_OK) {
-		tblog(LOG_ERROR, "Failed to open sqlite database for tls pinning");
+	if (tls_pins_init(TLS_PINS_DATABASE) != 0) {
 		return -1;
 	}
-	sprintf(query, "CREATE TABLE IF NOT EXISTS Pins (Hostname TEXT, Port INT, PRIMARY KEY (Hostname, Port))");
-	if (sqlite3_prepare_v2(db, query, 256, &res, 0) != SQLITE_OK) {
-		tblog(LOG_ERROR, "Pin table creation failed %s", sqlite3_errmsg(db));
-	}
-	sqlite3_step(res);
-	sqlite3_finalize(res);
 	nl_socket_set_local_port(netlink_sock, 100);
 	tblog(LOG_DEBUG, "policy engine has PID %u", nl_socket_get_local_port(netlink_sock));
-	if (pthread_mutex_init(&nl_sock_mutex, NULL) != 0) {
-		tblog(LOG_ERROR, "Failed to create mutex for netlink");
-		return -1;
-	}
 	nl_socket_disable_seq_check(netlink_sock);
-	nl_socket_modify_cb(netlink_sock, NL_CB_VALID, NL_CB_CUSTOM, recv_query, (void*)netlink_sock);
 	if (netlink_sock == NULL) {
 		tblog(LOG_ERROR, "Failed to allocate socket");
 		return -1;
@@ -195,6 +397,13 @@ int prep_communication(const char* username) {
 		tblog(LOG_ERROR, "Failed to connect to Generic Netlink control");
 		return -1;
 	}
+
+	/* Absorb connection storms.  Still root here, so rmem_max need not
+	 * be raised */
+	if (setsockopt(nl_socket_get_fd(netlink_sock), SOL_SOCKET, SO_RCVBUFFORCE, &buffer_size, sizeof(buffer_size)) != 0 &&
+	    nl_socket_set_buffer_size(netlink_sock, buffer_size, 0) < 0) {
+		tblog(LOG_WARNING, "Could not set netlink receive buffer to %d bytes", buffer_size);
+	}
 	
 	if ((family = genl_ctrl_resolve(netlink_sock, "TRUSTBASE")) < 0) {
 		tblog(LOG_ERROR, "Failed to resolve TRUSTBASE family identifier");
@@ -211,16 +420,46 @@ int prep_communication(const char* username) {
 		return -1;
 	}
 	
+	if (start_sender() != 0) {
+		return -1;
+	}
+	
 	// drop root permissions
 	change_to_user(username);
 	return 0;
 }
 	
-int listen_for_queries() {
+/**
+ * Receives queries until shut down.  Datagrams are taken from the socket
+ * in batches and their messages handed to worker threads, so the socket
+ * is drained even while queries are being set up.
+ * @param worker_count number of worker threads handling messages
+ */
+int listen_for_queries(int worker_count) {
 	struct sigaction new_action;
 	struct sigaction old_action;
+	struct mmsghdr msgs[NETLINK_RX_BATCH];
+	struct iovec iovs[NETLINK_RX_BATCH][2];
+	rx_buffer_t* buffers[NETLINK_RX_BATCH];
+	rx_buffer_t* buffer;
+	unsigned char* spill;
+	ssize_t size;
+	int fd;
+	int count;
+	int slots;
+	int i;
 
-	int err;
+	memset(buffers, 0, sizeof(buffers));
+	if (start_shards(worker_count) != 0) {
+		return -1;
+	}
+	fd = nl_socket_get_fd(netlink_sock);
+	/* Only the pages a large datagram lands on are ever backed */
+	spill = (unsigned char*)mmap(NULL, (size_t)NETLINK_RX_BATCH * NETLINK_RX_SPILL_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (spill == MAP_FAILED) {
+		tblog(LOG_WARNING, "Could not reserve room for large netlink messages");
+		spill = NULL;
+	}
 	keep_running = 1;
 	tblog(LOG_DEBUG, "listening for queries");
 
@@ -233,18 +472,281 @@ int listen_for_queries() {
 	}
 
 	while (keep_running == 1) {
-		err = nl_recvmsgs_default(netlink_sock);
-		if (err < 0) {
-			tblog(LOG_DEBUG, "nl_recv failed with code %i", err);
-			break;
+		/* Datagrams are received straight into buffers that the queries
+		 * made from them keep, so replace the slots handed out.  What
+		 * does not fit a slot runs over into its spill area */
+		for (slots = 0; slots < NETLINK_RX_BATCH; slots++) {
+			if (buffers[slots] == NULL && (buffers[slots] = rx_buffer_alloc(NETLINK_RX_SLOT_SIZE)) == NULL) {
+				break;
+			}
+			iovs[slots][0].iov_base = buffers[slots]->data;
+			iovs[slots][0].iov_len = NETLINK_RX_SLOT_SIZE;
+			iovs[slots][1].iov_base = spill + (size_t)slots * NETLINK_RX_SPILL_SIZE;
+			iovs[slots][1].iov_len = NETLINK_RX_SPILL_SIZE;
+			memset(&msgs[slots].msg_hdr, 0, sizeof(msgs[slots].msg_hdr));
+			msgs[slots].msg_hdr.msg_iov = iovs[slots];
+			msgs[slots].msg_hdr.msg_iovlen = spill != NULL ? 2 : 1;
+		}
+		if (slots == 0) {
+			sched_yield();
+			continue;
+		}
+		/* Wait for a datagram and learn its size.  One too large for a
+		 * slot is received on its own into a buffer that fits it */
+		size = recv(fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+		if (size < 0) {
+			if (receive_failed("recv")) {
+				break;
+			}
+			continue;
+		}
+		if (size > NETLINK_RX_SLOT_SIZE) {
+			receive_large(fd, size, buffers[0]);
+			continue;
+		}
+		/* Then take whatever else is queued */
+		count = recvmmsg(fd, msgs, slots, MSG_DONTWAIT, NULL);
+		if (count < 0) {
+			if (errno != EAGAIN && receive_failed("recvmmsg")) {
+				break;
+			}
+			continue;
+		}
+		for (i = 0; i < count; i++) {
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				reject_truncated(buffers[i]->data, NETLINK_RX_SLOT_SIZE);
+				continue;
+			}
+			if (msgs[i].msg_len > NETLINK_RX_SLOT_SIZE) {
+				/* The slot's buffer stays for the next batch */
+				buffer = unspill(buffers[i], iovs[i][1].iov_base, msgs[i].msg_len);
+				if (buffer == NULL) {
+					reject_truncated(buffers[i]->data, NETLINK_RX_SLOT_SIZE);
+					continue;
+				}
+			}
+			else {
+				buffer = rx_buffer_shrink(buffers[i], msgs[i].msg_len);
+				buffers[i] = NULL;
+			}
+			route_datagram(buffer);
+			rx_buffer_put(buffer);
 		}
 	}
-	nl_socket_free(netlink_sock);
+	for (i = 0; i < NETLINK_RX_BATCH; i++) {
+		rx_buffer_put(buffers[i]);
+	}
+	if (spill != NULL) {
+		munmap(spill, (size_t)NETLINK_RX_BATCH * NETLINK_RX_SPILL_SIZE);
+	}
+	stop_shards();
 	tblog(LOG_DEBUG, "no longer listening for queries");
-	sqlite3_close(db);
 	return 0;
 }
 
+/**
+ * Sends the verdicts still queued and closes the netlink socket.  Plugins,
+ * CA validation and the timer answer queries through send_response, so
+ * this must wait until all of them have stopped.
+ */
+void close_communication(void) {
+	stop_sender();
+	nl_socket_free(netlink_sock);
+	tls_pins_close();
+	return;
+}
+
+/* Handles a failed receive.  Returns 1 if receiving must stop */
+int receive_failed(const char* call) {
+	if (errno == EINTR) {
+		return 0;
+	}
+	if (errno == ENOBUFS) {
+		METRIC_INC(netlink_overruns);
+		tblog(LOG_WARNING, "Netlink receive buffer overran, queries were lost");
+		return 0;
+	}
+	tblog(LOG_DEBUG, "%s failed with error %d", call, errno);
+	return 1;
+}
+
+/* Receives the next datagram, size bytes long, into a buffer of its own.
+ * If there is no room for it, only its start is taken into slot so its
+ * connection can still be answered */
+void receive_large(int fd, size_t size, rx_buffer_t* slot) {
+	rx_buffer_t* buffer;
+	ssize_t len;
+	buffer = rx_buffer_alloc(size);
+	if (buffer == NULL) {
+		len = recv(fd, slot->data, NETLINK_RX_SLOT_SIZE, 0);
+		if (len > 0) {
+			reject_truncated(slot->data, len);
+		}
+		return;
+	}
+	len = recv(fd, buffer->data, size, 0);
+	if (len <= 0) {
+		rx_buffer_put(buffer);
+		return;
+	}
+	buffer = rx_buffer_shrink(buffer, len);
+	route_datagram(buffer);
+	rx_buffer_put(buffer);
+	return;
+}
+
+/* Gathers a datagram that ran over its slot into its spill area into one
+ * buffer, and hands the spill area's pages back */
+rx_buffer_t* unspill(rx_buffer_t* slot, unsigned char* spill, size_t len) {
+	rx_buffer_t* buffer;
+	buffer = rx_buffer_alloc(len);
+	if (buffer != NULL) {
+		memcpy(buffer->data, slot->data, NETLINK_RX_SLOT_SIZE);
+		memcpy(buffer->data + NETLINK_RX_SLOT_SIZE, spill, len - NETLINK_RX_SLOT_SIZE);
+	}
+	madvise(spill, len - NETLINK_RX_SLOT_SIZE, MADV_DONTNEED);
+	return buffer;
+}
+
+/* Answers a query whose datagram could not be received whole, so its
+ * connection is not left waiting.  Only the start of the datagram is at
+ * hand, which is where the kernel puts the state pointer */
+void reject_truncated(unsigned char* data, int len) {
+	struct nlmsghdr* nlh;
+	struct nlattr* attr;
+	int remaining;
+	METRIC_INC(netlink_truncated);
+	nlh = (struct nlmsghdr*)data;
+	if (len >= NLMSG_HDRLEN + GENL_HDRLEN && nlh->nlmsg_type == family) {
+		remaining = (len < nlh->nlmsg_len ? len : nlh->nlmsg_len) - NLMSG_HDRLEN - GENL_HDRLEN;
+		for (attr = nlmsg_attrdata(nlh, GENL_HDRLEN); nla_ok(attr, remaining); attr = nla_next(attr, &remaining)) {
+			if (nla_type(attr) == TRUSTBASE_A_STATE_PTR && nla_len(attr) >= sizeof(uint64_t)) {
+				tblog(LOG_WARNING, "A query was too large to receive, rejecting its connection");
+				send_response(nlh->nlmsg_pid, nla_get_u64(attr), POLICY_RESPONSE_INVALID);
+				return;
+			}
+		}
+	}
+	tblog(LOG_WARNING, "Dropped a netlink message too large to receive");
+	return;
+}
+
+/* Hands each TrustBase message of a datagram to its connection's worker.
+ * Anything else, like acknowledgements of our responses, is ignored */
+void route_datagram(rx_buffer_t* buffer) {
+	struct nlmsghdr* nlh;
+	struct nlattr* attr;
+	rx_shard_t* shard;
+	rx_msg_t* msg;
+	uint64_t stptr;
+	int len;
+	len = buffer->len;
+	for (nlh = (struct nlmsghdr*)buffer->data; nlmsg_ok(nlh, len); nlh = nlmsg_next(nlh, &len)) {
+		if (nlh->nlmsg_type != family) {
+			continue;
+		}
+		attr = nlmsg_find_attr(nlh, GENL_HDRLEN, TRUSTBASE_A_STATE_PTR);
+		stptr = (attr != NULL && nla_len(attr) >= sizeof(uint64_t)) ? nla_get_u64(attr) : 0;
+		shard = &shards[((stptr * 0x9E3779B97F4A7C15ULL) >> 32) % shard_count];
+		msg = (rx_msg_t*)malloc(sizeof(rx_msg_t));
+		if (msg == NULL) {
+			tblog(LOG_WARNING, "Could not allocate netlink message, dropping it");
+			continue;
+		}
+		msg->next = NULL;
+		msg->nlh = nlh;
+		msg->buffer = buffer;
+		rx_buffer_get(buffer);
+		pthread_mutex_lock(&shard->mutex);
+		/* A worker far behind pushes back on the socket buffer */
+		while (shard->count >= NETLINK_SHARD_BACKLOG) {
+			pthread_cond_wait(&shard->not_full, &shard->mutex);
+		}
+		if (shard->tail != NULL) {
+			shard->tail->next = msg;
+		}
+		else {
+			shard->head = msg;
+		}
+		shard->tail = msg;
+		shard->count++;
+		pthread_cond_signal(&shard->not_empty);
+		pthread_mutex_unlock(&shard->mutex);
+	}
+	return;
+}
+
+void* shard_thread(void* arg) {
+	rx_shard_t* shard;
+	rx_msg_t* msg;
+	shard = (rx_shard_t*)arg;
+	while (1) {
+		pthread_mutex_lock(&shard->mutex);
+		while (shard->head == NULL && shard->running) {
+			pthread_cond_wait(&shard->not_empty, &shard->mutex);
+		}
+		/* Stopping workers finish what was received first */
+		msg = shard->head;
+		if (msg == NULL) {
+			pthread_mutex_unlock(&shard->mutex);
+			break;
+		}
+		shard->head = msg->next;
+		if (shard->head == NULL) {
+			shard->tail = NULL;
+		}
+		shard->count--;
+		pthread_cond_signal(&shard->not_full);
+		pthread_mutex_unlock(&shard->mutex);
+		handle_message(msg->nlh, msg->buffer);
+		rx_buffer_put(msg->buffer);
+		free(msg);
+	}
+	return NULL;
+}
+
+int start_shards(int count) {
+	int i;
+	shards = (rx_shard_t*)calloc(count, sizeof(rx_shard_t));
+	if (shards == NULL) {
+		tblog(LOG_ERROR, "Failed to allocate %d netlink workers", count);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		pthread_mutex_init(&shards[i].mutex, NULL);
+		pthread_cond_init(&shards[i].not_empty, NULL);
+		pthread_cond_init(&shards[i].not_full, NULL);
+		shards[i].running = 1;
+		if (pthread_create(&shards[i].thread, NULL, shard_thread, &shards[i]) != 0) {
+			tblog(LOG_ERROR, "Failed to start netlink worker %d", i);
+			shard_count = i;
+			stop_shards();
+			return -1;
+		}
+	}
+	shard_count = count;
+	tblog(LOG_DEBUG, "Running %d netlink workers", count);
+	return 0;
+}
+
+void stop_shards(void) {
+	int i;
+	for (i = 0; i < shard_count; i++) {
+		pthread_mutex_lock(&shards[i].mutex);
+		shards[i].running = 0;
+		pthread_cond_signal(&shards[i].not_empty);
+		pthread_mutex_unlock(&shards[i].mutex);
+		pthread_join(shards[i].thread, NULL);
+		pthread_mutex_destroy(&shards[i].mutex);
+		pthread_cond_destroy(&shards[i].not_empty);
+		pthread_cond_destroy(&shards[i].not_full);
+	}
+	free(shards);
+	shards = NULL;
+	shard_count = 0;
+	return;
+}
+
 void int_handler(int signal) {
 	if (signal == SIGINT) {
 		tblog(LOG_DEBUG, "Caught SIGINT");
@@ -5,8 +5,25 @@
 #include <netlink/genl/ctrl.h>
 #include "../handshake-handler/communications.h"
 
+/* Datagrams taken from the socket per system call */
+#define NETLINK_RX_BATCH	32
+/* Room for one datagram, chains and hellos included.  Larger ones run
+ * over into a spill area of their own in a batch, and are received alone
+ * into a buffer that fits them when they come first */
+#define NETLINK_RX_SLOT_SIZE	65536
+#define NETLINK_RX_SPILL_SIZE	(1024 * 1024)
+/* Messages a worker may fall behind before receiving waits for it */
+#define NETLINK_SHARD_BACKLOG	4096
+#define DEFAULT_NETLINK_BUFFER_SIZE	(8 * 1024 * 1024)
+/* Verdicts queued for the sender at most, a power of two */
+#define RESPONSE_QUEUE_SIZE	8192
+/* Verdicts sent per sendmmsg at most */
+#define RESPONSE_BATCH		64
+/* A verdict message: headers, state pointer and result */
+#define RESPONSE_MSG_LEN	(NLMSG_HDRLEN + GENL_HDRLEN + NLA_ALIGN(NLA_HDRLEN + 8) + NLA_ALIGN(NLA_HDRLEN + 4))
+
 int send_response(uint32_t spid, uint64_t stptr, int result);
-int recv_query(struct nl_msg *msg, void *arg);
-int prep_communication(const char* username);
-int listen_for_queries();
+int prep_communication(const char* username, int buffer_size);
+int listen_for_queries(int worker_count);
+void close_communication(void);
 #endif
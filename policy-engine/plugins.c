@@ -44,6 +44,16 @@ void print_plugins(plugin_t* plugins, size_t plugin_count) {
 		else {
 			tblog(LOG_INFO, "\t\tErrors map to: Unknown");
 		}
+		tblog(LOG_INFO, "\t\tTier: %d", plugins[i].tier);
+		if (plugins[i].run_if_count > 0 || plugins[i].skip_if_count > 0) {
+			tblog(LOG_INFO, "\t\tConditions: %d run_if, %d skip_if", plugins[i].run_if_count, plugins[i].skip_if_count);
+		}
+		if (plugins[i].adaptive_percentile > 0) {
+			tblog(LOG_INFO, "\t\tTimeout: %d ms, adapting to the %2.1lfth latency percentile", plugins[i].timeout, plugins[i].adaptive_percentile * 100);
+		}
+		else {
+			tblog(LOG_INFO, "\t\tTimeout: %d ms", plugins[i].timeout);
+		}
 		//tblog(LOG_INFO, "\t\tVersion: %s", plugins[i].ver);
 		tblog(LOG_INFO, "\t\tPath: %s", plugins[i].path);
 		if (plugins[i].type == PLUGIN_TYPE_ASYNCHRONOUS) {
@@ -55,6 +65,12 @@ void print_plugins(plugin_t* plugins, size_t plugin_count) {
 		else {
 			tblog(LOG_INFO, "\t\tType: Unknown");
 		}
+		if (plugins[i].workers == PLUGIN_WORKERS_AUTO) {
+			tblog(LOG_INFO, "\t\tWorkers: One per CPU%s", plugins[i].thread_safe ? "" : " (not thread safe, using one)");
+		}
+		else {
+			tblog(LOG_INFO, "\t\tWorkers: %d%s", plugins[i].workers, plugins[i].thread_safe || plugins[i].workers == 1 ? "" : " (not thread safe, using one)");
+		}
 
 		if (plugins[i].handler_type == PLUGIN_HANDLER_TYPE_RAW) {
 			tblog(LOG_INFO, "\t\tHandler Type: Raw Data");
@@ -78,8 +94,11 @@ void print_plugins(plugin_t* plugins, size_t plugin_count) {
 int query_plugin(plugin_t* plugin, int id, query_t* query) {
 	/* Make a copy of the data for the plugins */
 	switch (plugin->handler_type) {
-		case PLUGIN_HANDLER_TYPE_RAW:
 		case PLUGIN_HANDLER_TYPE_OPENSSL:
+			/* Only these plugins look at the parsed chain */
+			query_chain(query);
+			return plugin->query(query->data);
+		case PLUGIN_HANDLER_TYPE_RAW:
 			return plugin->query(query->data);
 		case PLUGIN_HANDLER_TYPE_ADDON:
 			if (plugin->query_by_addon == NULL) {
@@ -156,11 +175,14 @@ void cleanup_plugin(void* arg) {
 	free(plugin->ver);
 	free(plugin->handler_str);
 	free(plugin->path);
+	free(plugin->run_if);
+	free(plugin->skip_if);
 	return;
 }
 
 int load_plugin_functions(plugin_t* plugin) {
 	void* handle;
+	int* thread_safe;
 	handle = dlopen(plugin->path, RTLD_LAZY);
 	if (!handle) {
 		return 1;
@@ -176,6 +198,11 @@ int load_plugin_functions(plugin_t* plugin) {
  	 * error check here */
 	plugin->generic_init_func = dlsym(handle, "initialize");
 	plugin->finalize = dlsym(handle, "finalize");
+	plugin->cancel = dlsym(handle, "cancel");
+	/* Plugins declare a reentrant query function by exporting
+	 * "int thread_safe = 1;" */
+	thread_safe = (int*)dlsym(handle, "thread_safe");
+	plugin->thread_safe = thread_safe != NULL && *thread_safe != 0;
 	return 0;
 }
 
@@ -3,10 +3,19 @@
 
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
+#include <pthread.h>
 #include "query_queue.h"
 #include "query.h"
 #include "addons.h"
 #include "trustbase_plugin.h"
+#include "latency.h"
+#include "breaker.h"
+
+#define DEFAULT_PLUGIN_TIMEOUT	2000 // in milliseconds
+/* workers setting asking for one thread per online CPU */
+#define PLUGIN_WORKERS_AUTO	(-1)
+/* Source of a run_if/skip_if condition that is the CA system */
+#define CONDITION_SOURCE_CA	(-1)
 
 enum {
 	PLUGIN_HANDLER_TYPE_UNKNOWN,
@@ -26,6 +35,12 @@ enum {
 	AGGREGATION_NECESSARY,
 };
 
+/* A "<source>:<response>" condition from a run_if or skip_if setting */
+typedef struct plugin_condition_t {
+	int source; /* plugin id or CONDITION_SOURCE_CA */
+	int response; /* PLUGIN_RESPONSE_VALID or PLUGIN_RESPONSE_INVALID */
+} plugin_condition_t;
+
 //typedef int (*query_func_raw)(const char*, const unsigned char*, size_t);
 //typedef int (*query_func_openssl)(const char*, STACK_OF(X509)*);
 
@@ -59,13 +74,42 @@ typedef struct plugin_t {
 		int (*finalize)(void);
 		int (*finalize_by_addon)(int);
 	};
+	/* used by plugins that can abandon work on a query (optional) */
+	int (*cancel)(int query_id);
 	char* path; // null-terminated path to plugin file
 	/* Aggregation group this plugin belongs to */
 	int aggregation;
+	/* Plugins run tier by tier, lowest first */
+	int tier;
+	/* The plugin only runs if all run_if conditions hold and none of
+	 * the skip_if conditions do */
+	plugin_condition_t* run_if;
+	int run_if_count;
+	plugin_condition_t* skip_if;
+	int skip_if_count;
 	/* Decision to map abstain decisions to */
 	int abstain_map;
 	/* Decision to map errors to */
 	int error_map;
+	/* Whether responses may be kept in the verdict cache */
+	int cacheable;
+	/* Longest a response may take, in milliseconds */
+	int timeout;
+	/* Latency percentile the deadline is derived from, 0 to always
+	 * allow the full timeout */
+	double adaptive_percentile;
+	/* Deadline in effect for new queries, in milliseconds */
+	int deadline;
+	latency_histogram_t latency;
+	breaker_t breaker;
+	/* Whether the plugin exports thread_safe, i.e. its query function
+	 * may run on several threads at once */
+	int thread_safe;
+	/* Configured number of worker threads or PLUGIN_WORKERS_AUTO */
+	int workers;
+	pthread_t* threads;
+	int thread_count;
+	init_data_t* idata;
 } plugin_t;
 
 void print_plugins(plugin_t* plugins, size_t plugin_count);
@@ -89,9 +89,8 @@ void* worker(void* arg) {
 }
 
 /* Trustbase will not delete the data pointed to by these parameters until 
- * all plugins have reported or there is a timeout. In a real plugin you
- * should copy the source data to avoid bad dereferences in the case of a
- * timeout. */
+ * this plugin has called back for the query, even if the query times out
+ * first. */
 int query(query_data_t* data) {
 	query_t* query;
 	query = (query_t*)malloc(sizeof(query_t));
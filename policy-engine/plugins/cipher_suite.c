@@ -51,6 +51,10 @@ typedef struct cipher_settings_t {
 
 cipher_settings_t cipher_settings;
 
+/* The settings are only written by initialize(), so query() may run on
+ * several threads at once */
+int thread_safe = 1;
+
 int initialize(init_data_t* idata) {
 	char* plugin_path;
 	char* config_path;
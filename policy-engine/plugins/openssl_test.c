@@ -8,6 +8,9 @@
 int query(query_data_t* data);
 void print_certificate(X509* cert);
 
+/* query() keeps no state, so it may run on several threads at once */
+int thread_safe = 1;
+
 void print_certificate(X509* cert) {
 	char subj[MAX_LENGTH+1];
 	char issuer[MAX_LENGTH+1];
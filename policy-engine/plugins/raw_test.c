@@ -5,6 +5,9 @@
 
 int query(query_data_t* data);
 
+/* query() keeps no state, so it may run on several threads at once */
+int thread_safe = 1;
+
 int query(query_data_t* data) {
 	/*FILE *f = fopen("/tmp/raw_ran.txt", "a");
 	if (f == NULL) {
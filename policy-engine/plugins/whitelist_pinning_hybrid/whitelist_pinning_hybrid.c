@@ -22,7 +22,13 @@
 #define MAX_LENGTH	1024
 #define PINNING_DATABASE "pinned_certs.db"
 
+/* Outcomes of compare_pin */
+#define PIN_MATCH	0
+#define PIN_MISMATCH	1
+#define PIN_LEGACY	2
+
 int (*plog)(tblog_level_t level, const char* format, ...);
+int (*get_fingerprint)(query_data_t* data, int cert_index, int kind, unsigned char* digest);
 char* plugin_path;
 char* database_path;
 
@@ -38,11 +44,13 @@ static int pem_append(char* filename, STACK_OF(X509)* chain);
 static int verify_hostname(const char* hostname, X509* cert);
 
 static time_t ASN1_GetTimeT(ASN1_TIME* time);
+static int compare_pin(sqlite3_stmt* statement, const char* hostname, unsigned char* hash, int hash_len);
 
 int initialize(init_data_t* idata) {
 	char* plugin_path_cpy;
 	
 	plog = idata->tblog;
+	get_fingerprint = idata->fingerprint;
 	
 	// Whitelist Init
 	plugin_path = idata->plugin_path;
@@ -81,10 +89,9 @@ int query(query_data_t* data) {
 	unsigned int white_fingerprint_len;
 
 	int rval;
-	unsigned char* hash;
-	unsigned char* stored_hash;
-	EVP_PKEY* pub_key;
-	unsigned char* pkey_buf;
+	unsigned char hash[PLUGIN_DIGEST_MAX_LEN];
+	int hash_len;
+	int match;
 	sqlite3* database;
 	sqlite3_stmt* statement;
 	time_t ptime;
@@ -102,12 +109,12 @@ int query(query_data_t* data) {
 	
 	plog(LOG_DEBUG, "Whitelist querying");
 		
-	/* Get the fingerprint for the leaf cert */	
-	digest = (EVP_MD*)EVP_sha1();
-	fingerprint_len = sizeof(fingerprint);
-	if (!get_cert_fingerprint(cert, digest, fingerprint, &fingerprint_len)) {
+	/* Get the fingerprint for the leaf cert, shared with other plugins */
+	fingerprint_len = get_fingerprint(data, 0, PLUGIN_DIGEST_CERT_SHA1, fingerprint);
+	if (fingerprint_len == 0) {
 		return PLUGIN_RESPONSE_ERROR;
 	}
+	digest = (EVP_MD*)EVP_sha1();
 	
 	plog(LOG_DEBUG, "Got fingerprint of incoming cert");
 
@@ -157,17 +164,12 @@ int query(query_data_t* data) {
 	
 	rval = PLUGIN_RESPONSE_VALID;
 	
-	// Get Certificate Public Key
+	// Get the hash of the certificate's public key, shared with other plugins
 	//cert = sk_X509_value(data->chain, 0);
-	pub_key = X509_get_pubkey(cert);
-	pkey_buf = NULL;
-	i2d_PUBKEY(pub_key, &pkey_buf);
-
-	// Hash it
-	hash = (unsigned char*) malloc(SHA256_DIGEST_LENGTH + 1);
-	hash[SHA256_DIGEST_LENGTH] = '\0';
-	SHA256(pkey_buf, strlen((char*)pkey_buf), hash);
-	OPENSSL_free(pkey_buf);
+	hash_len = get_fingerprint(data, 0, PLUGIN_DIGEST_SPKI_SHA256, hash);
+	if (hash_len == 0) {
+		return PLUGIN_RESPONSE_ERROR;
+	}
 
 	// Check the Database
 	database = NULL;
@@ -207,26 +209,27 @@ int query(query_data_t* data) {
 		rval = PLUGIN_RESPONSE_ERROR;
 	} else if (sqlite3_bind_int64(statement, 2, (sqlite_uint64)ptime) != SQLITE_OK) {
 		rval = PLUGIN_RESPONSE_ERROR;
-	} else if (sqlite3_step(statement) == SQLITE_ROW) {
+	} else if (sqlite3_step(statement) == SQLITE_ROW && (match = compare_pin(statement, (char*)data->hostname, hash, hash_len)) != PIN_LEGACY) {
 		plog(LOG_DEBUG, "Found a hit in pinning table");
 		
 		// There was a result, compare the stored hash with the new one
-		stored_hash = (unsigned char*)sqlite3_column_blob(statement, 0);
-		if (strcmp((char*)hash, (char*)stored_hash) != 0) {
+		if (match == PIN_MISMATCH) {
 			plog(LOG_DEBUG, "Pinned cert does not match");
 			rval = PLUGIN_RESPONSE_INVALID;
 		}
-		plog(LOG_DEBUG, "Pinned cert matches");
+		else {
+			plog(LOG_DEBUG, "Pinned cert matches");
+		}
 	} else {
 		plog(LOG_DEBUG, "Not found in pinning table. Now pinning new cert.");
 		
-		// There were no results, do an insert.
+		// There were no results, or an old style pin to replace, do an insert.
 		sqlite3_finalize(statement);
 		if (sqlite3_prepare_v2(database, "INSERT OR REPLACE INTO pinned VALUES(?1,?2,?3);", -1, &statement, NULL) != SQLITE_OK) {
 			rval = PLUGIN_RESPONSE_ERROR;
 		} else if (sqlite3_bind_text(statement, 1, (char*)data->hostname, -1, SQLITE_STATIC) != SQLITE_OK) {
 			rval = PLUGIN_RESPONSE_ERROR;
-		} else if (sqlite3_bind_text(statement, 2, (char*)hash, -1, SQLITE_STATIC) != SQLITE_OK) {
+		} else if (sqlite3_bind_blob(statement, 2, hash, hash_len, SQLITE_STATIC) != SQLITE_OK) {
 			rval = PLUGIN_RESPONSE_ERROR;
 		} else if (sqlite3_bind_int64(statement, 3, (sqlite_uint64)exptime) != SQLITE_OK) {
 			rval = PLUGIN_RESPONSE_ERROR;
@@ -241,7 +244,6 @@ int query(query_data_t* data) {
 
 	sqlite3_finalize(statement);
 	sqlite3_close(database);
-	free(hash);
 	return rval;
 }
 
@@ -456,3 +458,20 @@ static time_t ASN1_GetTimeT(ASN1_TIME* time){
 	/* Note: we did not adjust the time based on time zone information */
 	return mktime(&t);
 }
+
+/* Pins used to be stored as text holding a hash that stopped at the first
+ * zero byte of the key's DER encoding, which every key of the same type
+ * and size shares.  Such a pin says nothing about the key, so it is
+ * reported as legacy and replaced as on first use */
+static int compare_pin(sqlite3_stmt* statement, const char* hostname, unsigned char* hash, int hash_len) {
+	const unsigned char* stored_hash;
+	if (sqlite3_column_type(statement, 0) == SQLITE_TEXT) {
+		plog(LOG_WARNING, "CERT PINNING: The pin for %s predates key hashing and cannot be checked, pinning the current key", hostname);
+		return PIN_LEGACY;
+	}
+	stored_hash = (const unsigned char*)sqlite3_column_blob(statement, 0);
+	if (sqlite3_column_bytes(statement, 0) == hash_len && memcmp(stored_hash, hash, hash_len) == 0) {
+		return PIN_MATCH;
+	}
+	return PIN_MISMATCH;
+}
@@ -15,6 +15,7 @@
 #define MAX_LENGTH	1024
 
 int (*plog)(tblog_level_t level, const char* format, ...);
+int (*get_fingerprint)(query_data_t* data, int cert_index, int kind, unsigned char* digest);
 char* plugin_path;
 
 int initialize(init_data_t* idata);
@@ -28,6 +29,7 @@ static int pem_append(char* filename, STACK_OF(X509)* chain);
 int initialize(init_data_t* idata) {
 	plugin_path = idata->plugin_path;
 	plog = idata->tblog;
+	get_fingerprint = idata->fingerprint;
 	plog(LOG_DEBUG, "Whitelist initilized");
 	return 0;
 }
@@ -44,18 +46,13 @@ int query(query_data_t* data) {
 
 	plog(LOG_DEBUG, "Whitelist querying");
 	/* Only check the leaf certificate */
-	cert = sk_X509_value(data->chain, 0);
-	//print_certificate(cert);
 	
-	/* Get the fingerprint for the leaf cert */
-
-	//OpenSSL_add_all_algorithms(); // Need this?
-	
-	digest = (EVP_MD*)EVP_sha1();
-	fingerprint_len = sizeof(fingerprint);
-	if (!get_cert_fingerprint(cert, digest, fingerprint, &fingerprint_len)) {
+	/* Get the fingerprint for the leaf cert, shared with other plugins */
+	fingerprint_len = get_fingerprint(data, 0, PLUGIN_DIGEST_CERT_SHA1, fingerprint);
+	if (fingerprint_len == 0) {
 		return PLUGIN_RESPONSE_ERROR;
 	}
+	digest = (EVP_MD*)EVP_sha1();
 	
 	plog(LOG_DEBUG, "Got fingerprint");
 
@@ -11,24 +11,80 @@
 #include "configuration.h"
 #include "query.h"
 #include "query_queue.h"
-#include "linked_list.h"
+#include "query_index.h"
+#include "query_pool.h"
 #include "plugins.h"
 #include "policy_response.h"
 #include "trustbase_plugin.h"
 #include "ca_validation.h"
 #include "tb_logging.h"
+#include "timer_wheel.h"
+#include "singleflight.h"
+#include "metrics.h"
+#include "cert_intern.h"
 #include "policy_engine.h"
 
 #include <unistd.h>
 #include <string.h>
 
-#define TRUSTBASE_PLUGIN_TIMEOUT	(2) // in seconds
+#define TIMER_WHEEL_TICK		(10) // in milliseconds
+#define DEFAULT_QUEUE_CAPACITY		(4096)
+#define MAX_INFLIGHT_QUERIES		(1 << 17)
+#define DEFAULT_CACHE_TTL		(300) // in seconds
+#define DEFAULT_EDGE_CACHE_SIZE		(1024)
+#define SINGLEFLIGHT_BUCKETS		(4096)
+/* Adaptive deadlines are the observed latency percentile times
+ * ADAPTIVE_MARGIN, recomputed every ADAPTIVE_INTERVAL responses */
+#define ADAPTIVE_MARGIN			(1.5)
+#define ADAPTIVE_MIN_SAMPLES		(32)
+#define ADAPTIVE_INTERVAL		(64)
+#define ADAPTIVE_DECAY_SAMPLES		(4096)
+#define ADAPTIVE_MIN_DEADLINE		(20) // in milliseconds
+/* How long past its timeout an asynchronous plugin may keep a query */
+#define PLUGIN_RECLAIM_GRACE		(30000) // in milliseconds
+
+/* Outcomes of check_conditions */
+enum {
+	CONDITIONS_RUN,
+	CONDITIONS_SKIP,
+	CONDITIONS_WAIT,
+};
 
 policy_context_t context;
 
 static void* plugin_thread_init(void* arg);
-static void* decider_thread_init(void* arg);
+static void start_plugin(int plugin_id, thread_param_t* params);
+static void stop_plugin(int plugin_id);
+static void* ca_thread_init(void* arg);
+static void root_store_reloaded(void);
+static void record_ca_response(query_t* query, int result);
 static int async_callback(int plugin_id, int query_id, int result);
+static int plugin_fingerprint(query_data_t* data, int cert_index, int kind, unsigned char* digest);
+static int record_response(query_t* query, int plugin_id, int result);
+static void release_plugin(query_t* query, int plugin_id);
+static void plugin_asked(query_t* query, int plugin_id);
+static void arm_reclaim(query_t* query);
+static void reclaim_plugins(void* arg);
+static query_t* lookup_query(int id);
+static void put_query(query_t* query);
+static void release_ca(query_t* query, int unused);
+static int is_finalized(query_t* query);
+static void tally_init(query_t* query);
+static void tally_response(query_t* query, int plugin_id, int result);
+static void tally_skip(query_t* query, int plugin_id);
+static void tally_decide(query_t* query);
+static void prefill_query(query_t* query);
+static void cache_query(query_t* query, int final_response);
+static void answer_waiters(query_t* query, int final_response);
+static void dispatch_plugins(query_t* query, int can_block);
+static int check_conditions(query_t* query, int plugin_id);
+static int condition_met(query_t* query, plugin_condition_t* condition);
+static void cancel_plugins(query_t* query);
+static unsigned int elapsed_ms(query_t* query);
+static int next_deadline(query_t* query, unsigned int elapsed);
+static void observe_latency(int plugin_id, unsigned int ms);
+static void query_timeout(void* arg);
+static void finish_query(query_t* query);
 static int aggregate_responses(query_t* query, int ca_system_response);
 
 static volatile int keep_running;
@@ -36,17 +92,98 @@ static volatile int keep_running;
 typedef struct { unsigned char b[3]; } be24, le24;
 
 
-int poll_schemes(uint32_t spid, uint64_t stptr, char* hostname, uint16_t port, unsigned char* cert_data, size_t len, char* client_hello, size_t client_hello_len, char* server_hello, size_t server_hello_len) {
+/**
+ * Starts validating a certificate chain, or answers it from the cache
+ * @param payload buffer that cert_data and the hellos point into, which
+ * the query keeps instead of copying them, or NULL to copy them
+ */
+int poll_schemes(uint32_t spid, uint64_t stptr, char* hostname, uint16_t port, unsigned char* cert_data, size_t len, char* client_hello, size_t client_hello_len, char* server_hello, size_t server_hello_len, rx_buffer_t* payload) {
 	static int id = 0;
-	int i;
+	int cached;
+	int verdict;
+	int complete;
+	unsigned char key[VERDICT_CACHE_KEY_LEN];
 	query_t* query;
+	METRIC_INC(queries);
+	if (context.verdict_cache != NULL || context.flights != NULL) {
+		verdict_cache_key(key, hostname, port, cert_data, len);
+	}
+	/* Answer straight from the cache if the whole verdict is known */
+	cached = 0;
+	if (context.verdict_cache != NULL) {
+		cached = verdict_cache_lookup(context.verdict_cache, key, &verdict, NULL, NULL);
+		if (cached && verdict != VERDICT_UNKNOWN) {
+			tblog(LOG_INFO, "Policy Engine reporting cached verdict for %s", hostname);
+			METRIC_INC(cache_hits);
+			send_response(spid, stptr, verdict);
+			return 0;
+		}
+	}
+	/* Otherwise wait for an identical query that is already running */
+	if (context.flights != NULL && singleflight_join(context.flights, key, spid, stptr)) {
+		tblog(LOG_DEBUG, "Coalesced query for %s with one in flight", hostname);
+		METRIC_INC(coalesced);
+		return 0;
+	}
 	/* Validation */
-	query = create_query(context.plugin_count, id++, spid, stptr, hostname, port, cert_data, len, client_hello, client_hello_len, server_hello, server_hello_len);
-	list_add(context.timeout_list, query);
-	enqueue(context.decider_queue, query);
-	for (i = 0; i < context.plugin_count; i++) {
-		enqueue(context.plugins[i].queue, query);
+	/* Netlink workers create queries concurrently */
+	query = create_query(context.plugin_count, __atomic_fetch_add(&id, 1, __ATOMIC_RELAXED), spid, stptr, hostname, port, cert_data, len, client_hello, client_hello_len, server_hello, server_hello_len, payload);
+	if (query == NULL) {
+		return 1;
+	}
+	if (index_add(context.inflight, query) != 0) {
+		send_response(spid, stptr, POLICY_RESPONSE_INVALID);
+		free_query(query);
+		return 1;
 	}
+	/* Our own reference, the creator's belongs to whoever sends the verdict */
+	query_get(query);
+	tally_init(query);
+	query->tier = 0;
+	query->tier_pending = 0;
+	query->tier_waiting = 0;
+	timer_init(&query->timer, query_timeout, query);
+	timer_init(&query->reclaim_timer, reclaim_plugins, query);
+	clock_gettime(CLOCK_MONOTONIC, &query->start);
+	if (context.verdict_cache != NULL || context.flights != NULL) {
+		memcpy(query->key, key, VERDICT_CACHE_KEY_LEN);
+	}
+	if (context.flights != NULL) {
+		singleflight_lead(context.flights, query);
+	}
+	/* Partially cached, only ask whoever is missing */
+	if (cached) {
+		prefill_query(query);
+		pthread_mutex_lock(&query->mutex);
+		complete = query->verdict == QUERY_DECIDED_INVALID || (query->verdict == QUERY_DECIDED_VALID && query->ca_done);
+		query->finalized = complete;
+		pthread_mutex_unlock(&query->mutex);
+		if (complete) {
+			finish_query(query);
+			put_query(query);
+			return 0;
+		}
+	}
+	/* The CA system runs alongside the plugins.  The verdict can be sent
+	 * before it is done, so its worker needs a reference of its own.  A
+	 * cached CA answer makes it unnecessary */
+	if (!query->ca_done) {
+		query_get(query);
+		if (enqueue(context.ca_queue, query) == 0) {
+			/* Nobody else has seen this query yet, so fail it right here */
+			tblog(LOG_WARNING, "CA queue is full, rejecting query %d", query->data->id);
+			query->finalized = 1;
+			timer_cancel(context.timer_wheel, &query->timer);
+			send_response(spid, stptr, POLICY_RESPONSE_INVALID);
+			answer_waiters(query, POLICY_RESPONSE_INVALID);
+			put_query(query);
+			put_query(query);
+			put_query(query);
+			return 1;
+		}
+	}
+	dispatch_plugins(query, 1);
+	put_query(query);
 	return 0;
 }
 
@@ -54,14 +191,28 @@ int poll_schemes(uint32_t spid, uint64_t stptr, char* hostname, uint16_t port, u
 int main(int argc, char* argv[]) {
 	int i;
 	pthread_t logging_thread;
-	pthread_t decider_thread;
-	pthread_t* plugin_threads;
-	thread_param_t decider_thread_params;
+	pthread_t timer_thread;
+	pthread_t metrics_thread;
+	pthread_t root_store_thread;
+	pthread_t* ca_threads;
+	long cpus;
 	thread_param_t* plugin_thread_params;
 	char username[MAX_USERNAME_LEN + 1];
-	char* plugin_name;
 	
 	keep_running = 1;
+	context.ca_worker_count = CA_WORKERS_AUTO;
+	context.receive_worker_count = 1;
+	context.netlink_buffer_size = DEFAULT_NETLINK_BUFFER_SIZE;
+	context.queue_capacity = DEFAULT_QUEUE_CAPACITY;
+	context.queue_overflow = QUEUE_OVERFLOW_BLOCK;
+	context.cache_size = 0;
+	context.cache_ttl = DEFAULT_CACHE_TTL;
+	context.edge_cache_size = DEFAULT_EDGE_CACHE_SIZE;
+	context.intern_size = DEFAULT_CERT_INTERN_SIZE;
+	context.verdict_cache = NULL;
+	context.flights = NULL;
+	context.metrics_interval = DEFAULT_METRICS_INTERVAL;
+	context.root_store_path = NULL;
 	
 	/* Start Logging */
 	tblog_init("/var/log/trustbase.log", LOG_DEBUG);
@@ -69,8 +220,22 @@ int main(int argc, char* argv[]) {
 	pthread_create(&logging_thread, NULL, read_ktblog, NULL);
 	
 	load_config(&context, argv[1], username);
+	context.necessary_count = 0;
+	context.congress_count = 0;
+	context.tier_count = 1;
+	for (i = 0; i < context.plugin_count; i++) {
+		if (context.plugins[i].tier >= context.tier_count) {
+			context.tier_count = context.plugins[i].tier + 1;
+		}
+		if (context.plugins[i].aggregation == AGGREGATION_NECESSARY) {
+			context.necessary_count++;
+		}
+		else if (context.plugins[i].aggregation == AGGREGATION_CONGRESS) {
+			context.congress_count++;
+		}
+	}
 	
-	if (prep_communication(username) != 0) {
+	if (prep_communication(username, context.netlink_buffer_size) != 0) {
 		tblog(LOG_ERROR, "Could not prepare the netlink socket, exiting...");
 		pthread_kill(logging_thread, SIGTERM);
 		tblog_close();
@@ -81,45 +246,107 @@ int main(int argc, char* argv[]) {
 	init_plugins(context.addons, context.addon_count, context.plugins, context.plugin_count);
 	print_addons(context.addons, context.addon_count);
 	tblog(LOG_DEBUG, "Congress Threshold is %2.1lf", context.congress_threshold);
+	if (context.ca_worker_count == CA_WORKERS_AUTO) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		context.ca_worker_count = cpus > 0 ? cpus : 1;
+	}
+	tblog(LOG_DEBUG, "Running %d CA validation threads", context.ca_worker_count);
+	if (context.receive_worker_count == RECEIVE_WORKERS_AUTO) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		context.receive_worker_count = cpus > 0 ? cpus : 1;
+	}
 	print_plugins(context.plugins, context.plugin_count);
 
-	/* Decider thread (runs CA system and aggregates plugin verdicts */
-	decider_thread_params.plugin_id = -1;
-	context.decider_queue = make_queue("decider");
-	context.timeout_list = list_create();
-	pthread_create(&decider_thread, NULL, decider_thread_init, &decider_thread_params);
+	/* Timer thread (enforces plugin deadlines for every in-flight query) */
+	context.timer_wheel = timer_wheel_create(TIMER_WHEEL_TICK);
+	pthread_create(&timer_thread, NULL, timer_wheel_run, context.timer_wheel);
+
+	/* CA validation threads (run the CA system on each query, in
+	 * parallel with the plugins).  The final verdict is sent by whichever
+	 * of them, the plugins or the timer thread completes the query */
+	context.ca_queue = make_queue("ca", context.queue_capacity, context.queue_overflow);
+	context.inflight = index_create(MAX_INFLIGHT_QUERIES);
+	if (context.cache_size > 0) {
+		tblog(LOG_DEBUG, "Caching up to %d verdicts for %d seconds", context.cache_size, context.cache_ttl);
+		context.verdict_cache = verdict_cache_create(context.cache_size, context.cache_ttl, context.plugin_count);
+	}
+	/* Coalescing hands one verdict to several connections, which is only
+	 * right if no plugin looks at more than hostname, port and chain */
+	for (i = 0; i < context.plugin_count && context.plugins[i].cacheable; i++);
+	if (i == context.plugin_count) {
+		context.flights = singleflight_create(SINGLEFLIGHT_BUCKETS);
+	}
+	else {
+		tblog(LOG_INFO, "Plugin %s opted out of caching, identical queries will not be coalesced", context.plugins[i].name);
+	}
+	if (context.root_store_path == NULL) {
+		context.root_store_path = default_root_store_path();
+	}
+	edge_cache_init(context.edge_cache_size);
+	cert_intern_init(context.intern_size);
+	/* Every CA validation thread shares one store, rebuilt in the
+	 * background whenever the bundle changes */
+	context.root_store = context.root_store_path != NULL ? root_store_create(context.root_store_path) : NULL;
+	if (context.root_store != NULL) {
+		context.root_store->reloaded = root_store_reloaded;
+		pthread_create(&root_store_thread, NULL, root_store_watch, context.root_store);
+	}
+	ca_threads = (pthread_t*)malloc(sizeof(pthread_t) * context.ca_worker_count);
+	for (i = 0; i < context.ca_worker_count; i++) {
+		pthread_create(&ca_threads[i], NULL, ca_thread_init, NULL);
+	}
 
 
 	/* Plugin Threading */
 	plugin_thread_params = (thread_param_t*)malloc(sizeof(thread_param_t) * context.plugin_count);
-	plugin_threads = (pthread_t*)malloc(sizeof(pthread_t) * context.plugin_count);
 	for (i = 0; i < context.plugin_count; i++) {
-		context.plugins[i].queue = make_queue(context.plugins[i].name); // XXX relocate this
-		plugin_thread_params[i].plugin_id = i;
-		pthread_create(&plugin_threads[i], NULL, plugin_thread_init, &plugin_thread_params[i]);
+		start_plugin(i, &plugin_thread_params[i]);
 	}
 
-	listen_for_queries();
+	if (context.metrics_interval > 0) {
+		pthread_create(&metrics_thread, NULL, metrics_run, &context);
+	}
+
+	listen_for_queries(context.receive_worker_count);
 
 	// Cleanup
 	keep_running = 0;
+	if (context.metrics_interval > 0) {
+		pthread_cancel(metrics_thread);
+		pthread_join(metrics_thread, NULL);
+	}
+	metrics_log(&context);
 	for (i = context.plugin_count - 1; i >= 0; i--) {
-		plugin_name = (char*)calloc(strlen(context.plugins[i].name) + 1, 1);
-		strcpy(plugin_name, context.plugins[i].name);
-		tblog(LOG_INFO, "canceling plugin thread %d", i);
-		pthread_cancel(plugin_threads[i]);
-		pthread_join(plugin_threads[i], NULL);
-		free_queue(context.plugins[i].queue, plugin_name);
-		free(plugin_name);
-	}
-	pthread_cancel(decider_thread);
-	pthread_join(decider_thread, NULL);
-	free_queue(context.decider_queue, "decider");
-	list_free(context.timeout_list);
+		stop_plugin(i);
+	}
+	for (i = 0; i < context.ca_worker_count; i++) {
+		tblog(LOG_INFO, "canceling CA validation thread %d", i);
+		pthread_cancel(ca_threads[i]);
+		queue_wake_all(context.ca_queue);
+		pthread_join(ca_threads[i], NULL);
+	}
+	if (context.root_store != NULL) {
+		pthread_cancel(root_store_thread);
+		pthread_join(root_store_thread, NULL);
+	}
+	pthread_cancel(timer_thread);
+	pthread_join(timer_thread, NULL);
+	timer_wheel_free(context.timer_wheel);
+	free_queue(context.ca_queue, release_ca, 0);
+	index_free(context.inflight);
+	verdict_cache_free(context.verdict_cache);
+	singleflight_free(context.flights);
+	root_store_free(context.root_store);
+	edge_cache_free();
+	cert_intern_drain();
+	free(context.root_store_path);
 	free(context.plugins);
 	close_addons(context.addons, context.addon_count);
+	/* Every thread that could still send a verdict is gone */
+	close_communication();
 	free(plugin_thread_params);
-	free(plugin_threads);
+	free(ca_threads);
+	pool_drain();
 
 	tblog(LOG_INFO, "\n\n### Closing Policy Engine ### Closing Logging ###\n");
 	pthread_kill(logging_thread, SIGTERM);
@@ -127,20 +354,19 @@ int main(int argc, char* argv[]) {
 	return 0;
 }
 
-void* plugin_thread_init(void* arg) {
-	queue_t* queue;
-	int plugin_id;
-	thread_param_t* params;
+/**
+ * Initializes a plugin and starts the threads consuming its queue.  A
+ * plugin gets more than one only if it declares itself thread safe.
+ */
+void start_plugin(int plugin_id, thread_param_t* params) {
 	plugin_t* plugin;
-	query_t* query;
-	int result;
 	init_data_t* idata;
-
-	params = (thread_param_t*)arg;
-	plugin_id = params->plugin_id;
+	long cpus;
+	int count;
+	int i;
 	plugin = &context.plugins[plugin_id];
-	queue = plugin->queue;
-	
+	plugin->queue = make_queue(plugin->name, context.queue_capacity, context.queue_overflow);
+
 	idata = NULL;
 	if (plugin->generic_init_func != NULL) {
 		idata = (init_data_t*)malloc(sizeof(init_data_t));
@@ -151,151 +377,964 @@ void* plugin_thread_init(void* arg) {
 		idata->plugin_path = plugin->path;
 		idata->tblog = tblog;
 		idata->callback = (plugin->type == PLUGIN_TYPE_SYNCHRONOUS) ? NULL : async_callback;
+		idata->fingerprint = plugin_fingerprint;
 		plugin->init(idata);
 	}
-	// Set up our cleanup
-	pthread_cleanup_push(cleanup_plugin, plugin);
-	tblog(LOG_DEBUG, "Plugin %s ready", plugin->name);
+	plugin->idata = idata;
+
+	count = plugin->workers;
+	if (count == PLUGIN_WORKERS_AUTO) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		count = cpus > 0 ? cpus : 1;
+	}
+	/* Addons serialize their plugins themselves, so they get one thread */
+	if (count > 1 && (!plugin->thread_safe || plugin->handler_type == PLUGIN_HANDLER_TYPE_ADDON)) {
+		tblog(LOG_WARNING, "Plugin %s is not thread safe, running it on a single thread", plugin->name);
+		count = 1;
+	}
+	plugin->threads = (pthread_t*)malloc(sizeof(pthread_t) * count);
+	plugin->thread_count = count;
+	params->plugin_id = plugin_id;
+	for (i = 0; i < count; i++) {
+		pthread_create(&plugin->threads[i], NULL, plugin_thread_init, params);
+	}
+	tblog(LOG_DEBUG, "Plugin %s ready with %d thread(s)", plugin->name, count);
+	return;
+}
+
+/**
+ * Stops every thread of a plugin and finalizes it
+ */
+void stop_plugin(int plugin_id) {
+	plugin_t* plugin;
+	int i;
+	plugin = &context.plugins[plugin_id];
+	tblog(LOG_INFO, "canceling plugin threads for %s", plugin->name);
+	for (i = 0; i < plugin->thread_count; i++) {
+		pthread_cancel(plugin->threads[i]);
+	}
+	queue_wake_all(plugin->queue);
+	for (i = 0; i < plugin->thread_count; i++) {
+		pthread_join(plugin->threads[i], NULL);
+	}
+	free_queue(plugin->queue, release_plugin, plugin_id);
+	cleanup_plugin(plugin);
+	free(plugin->idata);
+	free(plugin->threads);
+	return;
+}
+
+void* plugin_thread_init(void* arg) {
+	queue_t* queue;
+	int plugin_id;
+	thread_param_t* params;
+	plugin_t* plugin;
+	query_t* query;
+	int result;
+
+	params = (thread_param_t*)arg;
+	plugin_id = params->plugin_id;
+	plugin = &context.plugins[plugin_id];
+	queue = plugin->queue;
+	
 	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	while (keep_running == 1) {
 		query = dequeue(queue);
+		/* Nothing this plugin says can change a verdict already sent */
+		if (is_finalized(query)) {
+			tblog(LOG_DEBUG, "Skipping decided query %d in plugin %s", query->data->id, plugin->name);
+			release_plugin(query, plugin_id);
+			continue;
+		}
 		if (plugin->type == PLUGIN_TYPE_SYNCHRONOUS) {
 			tblog(LOG_DEBUG, "Querying synch plugin %s", plugin->name);
 			result = query_plugin(plugin, plugin_id, query);
-			query->responses[plugin_id] = result;
-			pthread_mutex_lock(&query->mutex);
-			query->num_responses++;
-			if (query->num_responses == context.plugin_count) {
-				pthread_cond_signal(&query->threshold_met);
+			/* A late answer was already counted as a timeout */
+			if (record_response(query, plugin_id, result)) {
+				breaker_record(&plugin->breaker, result == PLUGIN_RESPONSE_ERROR);
 			}
-			pthread_mutex_unlock(&query->mutex);
+			release_plugin(query, plugin_id);
 		} else if (plugin->type == PLUGIN_TYPE_ASYNCHRONOUS) {
 			tblog(LOG_DEBUG, "Querying asynch plugin %s", plugin->name);
-			query_plugin(plugin, plugin_id, query);
+			/* The plugin's reference is dropped by async_callback,
+			 * unless the plugin failed and will never call back.
+			 * Ours keeps the query until it is marked as asked */
+			query_get(query);
+			result = query_plugin(plugin, plugin_id, query);
+			if (result == PLUGIN_RESPONSE_ERROR) {
+				if (record_response(query, plugin_id, result)) {
+					breaker_record(&plugin->breaker, 1);
+				}
+				release_plugin(query, plugin_id);
+			}
+			else {
+				plugin_asked(query, plugin_id);
+			}
+			put_query(query);
 		}
 	}
-	if (idata != NULL) {
-		free(idata); // XXX this will not be called after a cancel
-	}
-	
-	pthread_cleanup_pop(1);
 	return NULL;
 }
 
-void* decider_thread_init(void* arg) {
+void* ca_thread_init(void* arg) {
 	queue_t* queue;
 	query_t* query;
+	X509_STORE* store;
 	int ca_system_response;
-	struct timespec time_to_wait;
-	struct timeval now;
-	int err;
-	int final_response;
-	X509_STORE* root_store;
-	queue = context.decider_queue;
+	int slot;
+	queue = context.ca_queue;
 	
-	root_store = make_new_root_store();
 	while (keep_running == 1) {
 		query = dequeue(queue);
-		ca_system_response =  query_store(query->data->hostname, query->data->chain, root_store);
-		gettimeofday(&now, NULL);
-		time_to_wait.tv_sec = now.tv_sec + TRUSTBASE_PLUGIN_TIMEOUT;
-		time_to_wait.tv_nsec = now.tv_usec*1000UL;
-		pthread_mutex_lock(&query->mutex);
-		while (query->num_responses < context.plugin_count) {
-			err = pthread_cond_timedwait(&query->threshold_met, &query->mutex, &time_to_wait);
-			if (err == ETIMEDOUT) {
-				tblog(LOG_DEBUG, "A plugin timed out!\n");
-				break;
-			}
+		/* A necessary plugin may have rejected it already */
+		if (is_finalized(query)) {
+			put_query(query);
+			continue;
 		}
-		pthread_mutex_unlock(&query->mutex);
-		/* Either all plugins reported or some timed out.
- 		 * either way, remove the query from the timeout storage */
-		list_remove(context.timeout_list, query->data->id);
-		
-		final_response = aggregate_responses(query, ca_system_response);
-		send_response(query->spid, query->state_pointer, final_response);
-		free_query(query);
+		/* The root store is shared by all CA validation threads and
+		 * never changes while in use.  OpenSSL locks its lookups
+		 * internally so verification is safe here */
+		store = context.root_store != NULL ? root_store_acquire(context.root_store, &slot) : NULL;
+		if (store != NULL) {
+			ca_system_response = query_store(query->data->hostname, query_chain(query), store);
+			root_store_release(context.root_store, slot);
+		}
+		else {
+			tblog(LOG_WARNING, "No root store is loaded, rejecting the chain");
+			ca_system_response = PLUGIN_RESPONSE_INVALID;
+		}
+		record_ca_response(query, ca_system_response);
+		put_query(query);
 	}
 	return NULL;
 }
 
+/**
+ * Forgets cached answers once the CA system's trusted roots have changed
+ */
+void root_store_reloaded(void) {
+	edge_cache_flush();
+	if (context.verdict_cache != NULL) {
+		verdict_cache_flush(context.verdict_cache);
+	}
+	return;
+}
+
+/**
+ * Stores the CA system's answer on a query.  The CA system is a slot of
+ * the tally that every accepted query waits for, so this sends the final
+ * verdict if the plugins have already accepted it.
+ */
+void record_ca_response(query_t* query, int result) {
+	int complete;
+	int waiting;
+	pthread_mutex_lock(&query->mutex);
+	query->ca_response = result;
+	query->ca_done = 1;
+	complete = !query->finalized && query->verdict != QUERY_UNDECIDED;
+	if (complete) {
+		query->finalized = 1;
+	}
+	waiting = !query->finalized && query->tier_waiting > 0;
+	pthread_mutex_unlock(&query->mutex);
+	if (complete) {
+		finish_query(query);
+	}
+	else if (waiting) {
+		/* Plugins may have been waiting on the CA system.  CA threads
+		 * are not plugin workers, so they may wait for queue space */
+		dispatch_plugins(query, 1);
+	}
+	return;
+}
+
 int async_callback(int plugin_id, int query_id, int result) {
 	query_t* query;
+	int recorded;
 
-	query = list_get(context.timeout_list, query_id);
+	query = lookup_query(query_id);
 	if (query == NULL) {
+		tblog(LOG_INFO, "Plugin %d answered unknown query %d", plugin_id, query_id);
+		return 0;
+	}
+	recorded = record_response(query, plugin_id, result);
+	/* A late answer was already counted as a timeout */
+	if (recorded) {
+		breaker_record(&context.plugins[plugin_id].breaker, result == PLUGIN_RESPONSE_ERROR);
+	}
+	release_plugin(query, plugin_id);
+	put_query(query);
+	if (recorded == 0) {
 		tblog(LOG_INFO, "Plugin %d timed out on query %d but sent data anyway", plugin_id, query_id);
 		return 0; /* let plugin know this result timed out */
 	}
-	query->responses[plugin_id] = result;
+	return 1; /* let plugin know the callback was successful */
+}
+
+/* Plugins hold their query while they may use its data */
+int plugin_fingerprint(query_data_t* data, int cert_index, int kind, unsigned char* digest) {
+	return query_fingerprint(query_of(data), cert_index, kind, digest);
+}
+
+/**
+ * Stores a plugin's verdict on a query and, if that decides the query,
+ * sends the final verdict from the calling thread.  A rejection does not
+ * have to wait for the CA system or the other plugins, an acceptance
+ * waits for the CA system only.
+ * @returns 1 if the response was recorded, 0 if the query was already decided
+ */
+int record_response(query_t* query, int plugin_id, int result) {
+	int complete;
+	int advance;
 	pthread_mutex_lock(&query->mutex);
+	if (query->finalized || (query->plugin_state[plugin_id] & QUERY_PLUGIN_DONE)) {
+		pthread_mutex_unlock(&query->mutex);
+		return 0;
+	}
+	query->plugin_state[plugin_id] |= QUERY_PLUGIN_DONE | QUERY_PLUGIN_ANSWERED;
+	if (result != PLUGIN_RESPONSE_ERROR && context.plugins[plugin_id].cacheable) {
+		query->plugin_state[plugin_id] |= QUERY_PLUGIN_CACHEABLE;
+	}
+	if (result != PLUGIN_RESPONSE_ERROR) {
+		observe_latency(plugin_id, elapsed_ms(query) - query->sent_at[plugin_id]);
+	}
+	if (query->plugin_state[plugin_id] & QUERY_PLUGIN_SENT) {
+		query->tier_pending--;
+	}
 	query->num_responses++;
-	if (query->num_responses == context.plugin_count) {
-		pthread_cond_signal(&query->threshold_met);
+	tally_response(query, plugin_id, result);
+	complete = query->verdict == QUERY_DECIDED_INVALID || (query->verdict == QUERY_DECIDED_VALID && query->ca_done);
+	if (complete) {
+		query->finalized = 1;
 	}
+	/* The tier is done, or a plugin may have been waiting on this one */
+	advance = !complete && query->verdict == QUERY_UNDECIDED && (query->tier_pending == 0 || query->tier_waiting > 0);
 	pthread_mutex_unlock(&query->mutex);
-	return 1; /* let plugin know the callback was successful */
+	if (complete) {
+		finish_query(query);
+	}
+	else if (advance) {
+		/* Called from plugin threads, which must not wait on a queue */
+		dispatch_plugins(query, 0);
+	}
+	return 1;
 }
 
-int aggregate_responses(query_t* query, int ca_system_response) {
+/**
+ * Sends a query to the plugins of the lowest tier that still has to
+ * answer.  Later tiers only run once the earlier ones have answered (or
+ * timed out) and the verdict is still undecided, so cheap plugins can
+ * spare the expensive ones the work.  Within a tier, plugins with run_if
+ * or skip_if conditions wait for the answers those depend on and are left
+ * out of the tally if the conditions rule them out.  Called again whenever
+ * such an answer arrives.
+ * @param can_block whether a full plugin queue may be waited on
+ */
+void dispatch_plugins(query_t* query, int can_block) {
+	int claimed;
+	int complete;
+	int deadline;
+	int queuing;
+	int queued;
 	int i;
-	double congress_approved_count;
-	double congress_total;
+	/* Sending to the plugins may finish the query under our feet */
+	query_get(query);
+	pthread_mutex_lock(&query->mutex);
+	if (query->finalized || query->verdict != QUERY_UNDECIDED) {
+		pthread_mutex_unlock(&query->mutex);
+		put_query(query);
+		return;
+	}
+	claimed = 0;
+	while (query->verdict == QUERY_UNDECIDED && query->tier < context.tier_count) {
+		query->tier_waiting = 0;
+		for (i = 0; i < context.plugin_count; i++) {
+			if (context.plugins[i].tier != query->tier || (query->plugin_state[i] & (QUERY_PLUGIN_DONE | QUERY_PLUGIN_SENT))) {
+				continue;
+			}
+			switch (check_conditions(query, i)) {
+				case CONDITIONS_WAIT:
+					query->tier_waiting++;
+					break;
+				case CONDITIONS_SKIP:
+					tblog(LOG_DEBUG, "Skipping plugin %s on query %d", context.plugins[i].name, query->data->id);
+					METRIC_INC(condition_skips);
+					tally_skip(query, i);
+					break;
+				case CONDITIONS_RUN:
+				default:
+					/* Each plugin holds a reference until it has answered */
+					query_get(query);
+					query->plugin_state[i] |= QUERY_PLUGIN_SENT | QUERY_PLUGIN_HELD | QUERY_PLUGIN_QUEUING;
+					query->sent_at[i] = elapsed_ms(query);
+					query->tier_pending++;
+					claimed++;
+					break;
+			}
+		}
+		if (query->tier_pending > 0 || query->tier_waiting > 0) {
+			break;
+		}
+		query->tier++;
+	}
+	/* Skipped plugins can decide the query too */
+	complete = query->verdict == QUERY_DECIDED_INVALID || (query->verdict == QUERY_DECIDED_VALID && query->ca_done);
+	if (complete) {
+		query->finalized = 1;
+	}
+	else {
+		/* Only the plugins are on a deadline, the CA system is not */
+		deadline = next_deadline(query, elapsed_ms(query));
+		if (deadline >= 0) {
+			timer_add(context.timer_wheel, &query->timer, deadline);
+		}
+	}
+	pthread_mutex_unlock(&query->mutex);
+
+	for (i = 0; i < context.plugin_count && claimed > 0; i++) {
+		pthread_mutex_lock(&query->mutex);
+		queuing = query->plugin_state[i] & QUERY_PLUGIN_QUEUING;
+		query->plugin_state[i] &= ~QUERY_PLUGIN_QUEUING;
+		pthread_mutex_unlock(&query->mutex);
+		if (!queuing) {
+			continue;
+		}
+		claimed--;
+		/* A tripped breaker answers for the plugin right away */
+		if (!breaker_allow(&context.plugins[i].breaker)) {
+			METRIC_INC(breaker_skips);
+			record_response(query, i, PLUGIN_RESPONSE_ERROR);
+			release_plugin(query, i);
+			continue;
+		}
+		queued = can_block ? enqueue(context.plugins[i].queue, query) : enqueue_nowait(context.plugins[i].queue, query);
+		if (queued == 0) {
+			tblog(LOG_WARNING, "Queue for plugin %s is full, counting it as an error", context.plugins[i].name);
+			record_response(query, i, PLUGIN_RESPONSE_ERROR);
+			release_plugin(query, i);
+		}
+	}
+	if (complete) {
+		finish_query(query);
+	}
+	put_query(query);
+	return;
+}
+
+/**
+ * Checks a plugin's run_if and skip_if conditions against what the CA
+ * system and the other plugins have answered so far.  Caller must hold
+ * the query's mutex.
+ * @returns CONDITIONS_RUN, CONDITIONS_SKIP, or CONDITIONS_WAIT if an
+ * answer the conditions depend on is still missing
+ */
+int check_conditions(query_t* query, int plugin_id) {
+	plugin_t* plugin;
+	int waiting;
+	int met;
+	int i;
+	plugin = &context.plugins[plugin_id];
+	waiting = 0;
+	for (i = 0; i < plugin->skip_if_count; i++) {
+		met = condition_met(query, &plugin->skip_if[i]);
+		if (met == 1) {
+			return CONDITIONS_SKIP;
+		}
+		waiting |= met < 0;
+	}
+	for (i = 0; i < plugin->run_if_count; i++) {
+		met = condition_met(query, &plugin->run_if[i]);
+		if (met == 0) {
+			return CONDITIONS_SKIP;
+		}
+		waiting |= met < 0;
+	}
+	return waiting ? CONDITIONS_WAIT : CONDITIONS_RUN;
+}
+
+/**
+ * @returns 1 if the condition holds, 0 if it does not and -1 if its
+ * source has not answered yet
+ */
+int condition_met(query_t* query, plugin_condition_t* condition) {
+	int response;
+	if (condition->source == CONDITION_SOURCE_CA) {
+		if (!query->ca_done) {
+			return -1;
+		}
+		/* A CA system error is no endorsement */
+		response = query->ca_response == PLUGIN_RESPONSE_VALID ? PLUGIN_RESPONSE_VALID : PLUGIN_RESPONSE_INVALID;
+		return response == condition->response;
+	}
+	if (!(query->plugin_state[condition->source] & QUERY_PLUGIN_DONE)) {
+		return -1;
+	}
+	/* A skipped plugin gave no answer to match */
+	if (query->plugin_state[condition->source] & QUERY_PLUGIN_SKIPPED) {
+		return 0;
+	}
+	/* Nor did one that failed, abstained or timed out, whatever its
+	 * answer is mapped to */
+	return query->responses[condition->source] == condition->response;
+}
+
+/**
+ * Drops the reference a plugin was handed with the query.  Safe to call
+ * more than once for the same plugin.
+ */
+void release_plugin(query_t* query, int plugin_id) {
+	int held;
+	int cancel;
+	int i;
+	pthread_mutex_lock(&query->mutex);
+	held = query->plugin_state[plugin_id] & QUERY_PLUGIN_HELD;
+	query->plugin_state[plugin_id] &= ~QUERY_PLUGIN_HELD;
+	/* The last late plugin answered, nothing is left to reclaim */
+	cancel = 0;
+	if (held && query->reclaim_armed) {
+		for (i = 0; i < context.plugin_count && (query->plugin_state[i] & (QUERY_PLUGIN_HELD | QUERY_PLUGIN_ASKED)) != (QUERY_PLUGIN_HELD | QUERY_PLUGIN_ASKED); i++);
+		if (i == context.plugin_count) {
+			query->reclaim_armed = 0;
+			cancel = 1;
+		}
+	}
+	pthread_mutex_unlock(&query->mutex);
+	/* Once fired, the reclaim timer drops its own reference */
+	if (cancel && timer_cancel(context.timer_wheel, &query->reclaim_timer)) {
+		put_query(query);
+	}
+	if (held) {
+		put_query(query);
+	}
+	return;
+}
+
+/**
+ * Notes that an asynchronous plugin has been handed a query and now
+ * holds it until it calls back
+ */
+void plugin_asked(query_t* query, int plugin_id) {
+	pthread_mutex_lock(&query->mutex);
+	query->plugin_state[plugin_id] |= QUERY_PLUGIN_ASKED;
+	if (query->finalized) {
+		arm_reclaim(query);
+	}
+	pthread_mutex_unlock(&query->mutex);
+	return;
+}
 
-	congress_approved_count = 0;
-	congress_total = 0;
+/**
+ * Makes sure asynchronous plugins that were asked about a finalized query
+ * and never call back do not keep it forever: PLUGIN_RECLAIM_GRACE past
+ * their timeout their references are taken back.  The timer holds a
+ * reference of its own.  Caller must hold the query's mutex.
+ */
+void arm_reclaim(query_t* query) {
+	unsigned int elapsed;
+	int latest;
+	int deadline;
+	int i;
+	if (query->reclaim_armed) {
+		return;
+	}
+	latest = -1;
 	for (i = 0; i < context.plugin_count; i++) {
-		if (query->responses[i] == PLUGIN_RESPONSE_VALID) {
-			tblog(LOG_INFO, "Plugin %s returned valid", context.plugins[i].name);
+		if ((query->plugin_state[i] & (QUERY_PLUGIN_HELD | QUERY_PLUGIN_ASKED)) != (QUERY_PLUGIN_HELD | QUERY_PLUGIN_ASKED)) {
+			continue;
 		}
-		else if (query->responses[i] == PLUGIN_RESPONSE_INVALID) {
-			tblog(LOG_INFO, "Plugin %s returned invalid", context.plugins[i].name);
+		deadline = query->sent_at[i] + context.plugins[i].timeout + PLUGIN_RECLAIM_GRACE;
+		if (deadline > latest) {
+			latest = deadline;
 		}
-		else if (query->responses[i] == PLUGIN_RESPONSE_ERROR) {
-			if (context.plugins[i].error_map == PLUGIN_RESPONSE_INVALID) {
-				tblog(LOG_INFO, "Plugin %s returned with an error, which will be mapped to an invalid response", context.plugins[i].name);
-			}
-			else if (context.plugins[i].error_map == PLUGIN_RESPONSE_VALID) {
-				tblog(LOG_INFO, "Plugin %s returned with an error, which will be mapped to a valid response", context.plugins[i].name);
-			}
-			query->responses[i] = context.plugins[i].error_map;
+	}
+	if (latest < 0) {
+		return;
+	}
+	elapsed = elapsed_ms(query);
+	query->reclaim_armed = 1;
+	query_get(query);
+	timer_add(context.timer_wheel, &query->reclaim_timer, latest > elapsed ? latest - elapsed : 0);
+	return;
+}
+
+/**
+ * Timer wheel callback taking back the references of asynchronous plugins
+ * that never called back.  Such a plugin may no longer use the query's
+ * data; its callback, if it ever comes, finds no query.
+ */
+void reclaim_plugins(void* arg) {
+	query_t* query;
+	int released;
+	int i;
+	query = (query_t*)arg;
+	released = 0;
+	pthread_mutex_lock(&query->mutex);
+	query->reclaim_armed = 0;
+	for (i = 0; i < context.plugin_count; i++) {
+		if ((query->plugin_state[i] & (QUERY_PLUGIN_HELD | QUERY_PLUGIN_ASKED)) != (QUERY_PLUGIN_HELD | QUERY_PLUGIN_ASKED)) {
+			continue;
 		}
-		else if (query->responses[i] == PLUGIN_RESPONSE_ABSTAIN) {
-			if (context.plugins[i].abstain_map == PLUGIN_RESPONSE_INVALID) {
-				tblog(LOG_INFO, "Plugin %s abstained, which will be mapped to an invalid response", context.plugins[i].name);
+		tblog(LOG_WARNING, "Plugin %s never answered query %d, taking it back", context.plugins[i].name, query->data->id);
+		METRIC_INC(plugin_reclaims);
+		query->plugin_state[i] &= ~QUERY_PLUGIN_HELD;
+		released++;
+	}
+	pthread_mutex_unlock(&query->mutex);
+	while (released-- > 0) {
+		put_query(query);
+	}
+	/* The timer's reference */
+	put_query(query);
+	return;
+}
+
+/**
+ * Finds an in-flight query by id and takes a reference on it.  This
+ * works until the last reference is gone, even after the verdict has
+ * been sent, so that late plugins can still release theirs.
+ * @returns the query or NULL if there is none with that id
+ */
+query_t* lookup_query(int id) {
+	return index_get(context.inflight, id);
+}
+
+/**
+ * Drops a reference and frees the query if it was the last one
+ */
+void put_query(query_t* query) {
+	if (query_put(query)) {
+		/* Lookups hold the id's lock while taking a reference, so once
+		 * this returns nobody can find the query any more */
+		index_remove(context.inflight, query->data->id);
+		free_query(query);
+	}
+	return;
+}
+
+/**
+ * Drops the reference of a query left in the CA queue at shutdown
+ */
+void release_ca(query_t* query, int unused) {
+	put_query(query);
+	return;
+}
+
+/**
+ * @returns 1 if the query's verdict has been claimed, 0 otherwise
+ */
+int is_finalized(query_t* query) {
+	int finalized;
+	pthread_mutex_lock(&query->mutex);
+	finalized = query->finalized;
+	pthread_mutex_unlock(&query->mutex);
+	return finalized;
+}
+
+/**
+ * Timer wheel callback for a query with a plugin past its deadline.
+ * Missing responses of such plugins are counted as PLUGIN_RESPONSE_ERROR
+ * and the timer is re-armed for the next plugin still needed.
+ */
+void query_timeout(void* arg) {
+	query_t* query;
+	unsigned int elapsed;
+	int complete;
+	int advance;
+	int deadline;
+	int i;
+	query = (query_t*)arg;
+	elapsed = elapsed_ms(query);
+	pthread_mutex_lock(&query->mutex);
+	if (query->finalized) {
+		pthread_mutex_unlock(&query->mutex);
+		return;
+	}
+	for (i = 0; i < context.plugin_count; i++) {
+		if (!(query->plugin_state[i] & QUERY_PLUGIN_SENT) || (query->plugin_state[i] & QUERY_PLUGIN_DONE)) {
+			continue;
+		}
+		/* The wheel may fire up to a tick early */
+		if (query->sent_at[i] + __atomic_load_n(&context.plugins[i].deadline, __ATOMIC_RELAXED) > elapsed + TIMER_WHEEL_TICK) {
+			continue;
+		}
+		tblog(LOG_DEBUG, "Plugin %s timed out on query %d", context.plugins[i].name, query->data->id);
+		query->timed_out = 1;
+		query->plugin_state[i] |= QUERY_PLUGIN_DONE;
+		query->tier_pending--;
+		tally_response(query, i, PLUGIN_RESPONSE_ERROR);
+		/* All we know is that it took at least this long */
+		observe_latency(i, elapsed - query->sent_at[i]);
+		breaker_record(&context.plugins[i].breaker, 1);
+		METRIC_INC(plugin_timeouts);
+	}
+	complete = query->verdict == QUERY_DECIDED_INVALID || (query->verdict == QUERY_DECIDED_VALID && query->ca_done);
+	advance = 0;
+	if (complete) {
+		query->finalized = 1;
+	}
+	else if (query->verdict == QUERY_UNDECIDED && (query->tier_pending == 0 || query->tier_waiting > 0)) {
+		advance = 1;
+	}
+	else if (query->verdict == QUERY_UNDECIDED) {
+		/* Re-arming under the query's lock keeps finish_query from
+		 * missing the timer when it cancels it */
+		deadline = next_deadline(query, elapsed);
+		if (deadline >= 0) {
+			timer_add(context.timer_wheel, &query->timer, deadline);
+		}
+	}
+	pthread_mutex_unlock(&query->mutex);
+	if (complete) {
+		finish_query(query);
+	}
+	else if (advance) {
+		dispatch_plugins(query, 0);
+	}
+	return;
+}
+
+/**
+ * @returns milliseconds since the query was received
+ */
+unsigned int elapsed_ms(query_t* query) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - query->start.tv_sec) * 1000 + (now.tv_nsec - query->start.tv_nsec) / 1000000;
+}
+
+/**
+ * Finds the earliest deadline among the plugins a query still waits on.
+ * Caller must hold the query's mutex.
+ * @param elapsed milliseconds since the query was received
+ * @returns milliseconds until that deadline, or -1 if no plugin is pending
+ */
+int next_deadline(query_t* query, unsigned int elapsed) {
+	int deadline;
+	int earliest;
+	int i;
+	earliest = -1;
+	for (i = 0; i < context.plugin_count; i++) {
+		if (!(query->plugin_state[i] & QUERY_PLUGIN_SENT) || (query->plugin_state[i] & QUERY_PLUGIN_DONE)) {
+			continue;
+		}
+		deadline = query->sent_at[i] + __atomic_load_n(&context.plugins[i].deadline, __ATOMIC_RELAXED);
+		if (earliest < 0 || deadline < earliest) {
+			earliest = deadline;
+		}
+	}
+	if (earliest < 0) {
+		return -1;
+	}
+	return earliest > elapsed ? earliest - elapsed : 0;
+}
+
+/**
+ * Records how long a plugin took and, in adaptive mode, periodically
+ * moves its deadline to the configured latency percentile (with some
+ * headroom), never beyond its configured timeout
+ */
+void observe_latency(int plugin_id, unsigned int ms) {
+	plugin_t* plugin;
+	uint32_t samples;
+	unsigned int percentile;
+	int deadline;
+	plugin = &context.plugins[plugin_id];
+	if (plugin->adaptive_percentile <= 0) {
+		return;
+	}
+	samples = latency_record(&plugin->latency, ms);
+	if (samples < ADAPTIVE_MIN_SAMPLES || samples % ADAPTIVE_INTERVAL != 0) {
+		return;
+	}
+	percentile = latency_percentile(&plugin->latency, plugin->adaptive_percentile);
+	deadline = percentile * ADAPTIVE_MARGIN;
+	if (deadline < ADAPTIVE_MIN_DEADLINE) {
+		deadline = ADAPTIVE_MIN_DEADLINE;
+	}
+	if (deadline > plugin->timeout) {
+		deadline = plugin->timeout;
+	}
+	if (deadline != plugin->deadline) {
+		tblog(LOG_DEBUG, "Deadline of plugin %s is now %d ms", plugin->name, deadline);
+	}
+	__atomic_store_n(&plugin->deadline, deadline, __ATOMIC_RELAXED);
+	if (samples >= ADAPTIVE_DECAY_SAMPLES) {
+		latency_decay(&plugin->latency);
+	}
+	return;
+}
+
+/**
+ * Aggregates the responses, reports the verdict and drops the creator's
+ * reference.  Only the thread that set query->finalized may call this.
+ */
+void finish_query(query_t* query) {
+	int final_response;
+	/* Make sure the deadline cannot fire on a freed query */
+	timer_cancel(context.timer_wheel, &query->timer);
+	final_response = aggregate_responses(query, query->ca_response);
+	send_response(query->spid, query->state_pointer, final_response);
+	answer_waiters(query, final_response);
+	cache_query(query, final_response);
+	cancel_plugins(query);
+	pthread_mutex_lock(&query->mutex);
+	arm_reclaim(query);
+	pthread_mutex_unlock(&query->mutex);
+	put_query(query);
+	return;
+}
+
+/**
+ * Tells the plugins still working on a finalized query that their answer
+ * is no longer needed
+ */
+void cancel_plugins(query_t* query) {
+	int pending;
+	int i;
+	for (i = 0; i < context.plugin_count; i++) {
+		if (context.plugins[i].cancel == NULL) {
+			continue;
+		}
+		pthread_mutex_lock(&query->mutex);
+		pending = (query->plugin_state[i] & QUERY_PLUGIN_SENT) && !(query->plugin_state[i] & QUERY_PLUGIN_ANSWERED);
+		pthread_mutex_unlock(&query->mutex);
+		if (pending) {
+			context.plugins[i].cancel(query->data->id);
+		}
+	}
+	return;
+}
+
+/**
+ * Sends a finalized query's verdict to every identical query that was
+ * coalesced into it
+ */
+void answer_waiters(query_t* query, int final_response) {
+	query_waiter_t* waiter;
+	query_waiter_t* next;
+	if (context.flights == NULL) {
+		return;
+	}
+	waiter = singleflight_leave(context.flights, query);
+	while (waiter != NULL) {
+		next = waiter->next;
+		send_response(waiter->spid, waiter->state_pointer, final_response);
+		free(waiter);
+		waiter = next;
+	}
+	return;
+}
+
+/**
+ * Takes whatever the verdict cache knows about a new query as if the
+ * plugins and the CA system had just answered
+ */
+void prefill_query(query_t* query) {
+	int ca_response;
+	int verdict;
+	int i;
+	if (verdict_cache_lookup(context.verdict_cache, query->key, &verdict, query->responses, &ca_response) == 0) {
+		for (i = 0; i < context.plugin_count; i++) {
+			query->responses[i] = PLUGIN_RESPONSE_ERROR;
+		}
+		return;
+	}
+	pthread_mutex_lock(&query->mutex);
+	for (i = 0; i < context.plugin_count; i++) {
+		if (query->responses[i] == VERDICT_UNKNOWN) {
+			query->responses[i] = PLUGIN_RESPONSE_ERROR;
+			continue;
+		}
+		query->plugin_state[i] |= QUERY_PLUGIN_DONE | QUERY_PLUGIN_CACHED;
+		query->num_responses++;
+		tally_response(query, i, query->responses[i]);
+	}
+	if (ca_response != VERDICT_UNKNOWN) {
+		query->ca_response = ca_response;
+		query->ca_done = 1;
+	}
+	pthread_mutex_unlock(&query->mutex);
+	return;
+}
+
+/**
+ * Stores the answers to a decided query in the verdict cache.  The final
+ * verdict itself is only kept if nothing that went into it was an error,
+ * a timeout or a plugin that opted out of caching.
+ */
+void cache_query(query_t* query, int final_response) {
+	X509* leaf;
+	int days;
+	int seconds;
+	long lifetime;
+	int ca_response;
+	int deterministic;
+	int i;
+	if (context.verdict_cache == NULL) {
+		return;
+	}
+	/* Never trust a cached verdict past the leaf's expiry */
+	leaf = query_leaf(query);
+	if (leaf == NULL) {
+		return;
+	}
+	if (ASN1_TIME_diff(&days, &seconds, NULL, X509_get_notAfter(leaf)) == 0) {
+		cert_release(leaf);
+		return;
+	}
+	cert_release(leaf);
+	lifetime = (long)days * 86400 + seconds;
+	if (lifetime <= 0) {
+		return;
+	}
+	if (lifetime > context.cache_ttl) {
+		lifetime = context.cache_ttl;
+	}
+
+	/* The verdict has been sent, late plugins no longer touch responses */
+	deterministic = 1;
+	pthread_mutex_lock(&query->mutex);
+	for (i = 0; i < context.plugin_count; i++) {
+		if ((query->plugin_state[i] & QUERY_PLUGIN_DONE) && !(query->plugin_state[i] & (QUERY_PLUGIN_CACHEABLE | QUERY_PLUGIN_CACHED | QUERY_PLUGIN_SKIPPED))) {
+			deterministic = 0;
+		}
+		if (!(query->plugin_state[i] & QUERY_PLUGIN_CACHEABLE)) {
+			query->responses[i] = VERDICT_UNKNOWN;
+		}
+	}
+	ca_response = query->ca_done ? query->ca_response : VERDICT_UNKNOWN;
+	pthread_mutex_unlock(&query->mutex);
+	verdict_cache_store(context.verdict_cache, query->key, lifetime, deterministic ? final_response : VERDICT_UNKNOWN, query->responses, ca_response);
+	return;
+}
+
+/**
+ * Sets up the running tally of a query that has no responses yet
+ */
+void tally_init(query_t* query) {
+	query->necessary_pending = context.necessary_count;
+	query->congress_pending = context.congress_count;
+	query->congress_valid = 0;
+	query->congress_total = context.congress_count;
+	query->verdict = QUERY_UNDECIDED;
+	/* Without necessary or congress plugins only the CA system counts */
+	if (query->necessary_pending == 0 && query->congress_pending == 0) {
+		query->verdict = QUERY_DECIDED_VALID;
+	}
+	return;
+}
+
+/**
+ * Adds a plugin's response to the running tally and decides the query
+ * as soon as the outstanding responses can no longer change the result.
+ * Caller must hold the query's mutex.
+ */
+void tally_response(query_t* query, int plugin_id, int result) {
+	plugin_t* plugin;
+	plugin = &context.plugins[plugin_id];
+	/* Kept as answered, conditions and the cache need to tell errors and
+	 * abstentions from real answers */
+	query->responses[plugin_id] = result;
+
+	if (result == PLUGIN_RESPONSE_VALID) {
+		tblog(LOG_INFO, "Plugin %s returned valid", plugin->name);
+	}
+	else if (result == PLUGIN_RESPONSE_INVALID) {
+		tblog(LOG_INFO, "Plugin %s returned invalid", plugin->name);
+	}
+	else if (result == PLUGIN_RESPONSE_ERROR) {
+		if (plugin->error_map == PLUGIN_RESPONSE_INVALID) {
+			tblog(LOG_INFO, "Plugin %s returned with an error, which will be mapped to an invalid response", plugin->name);
+		}
+		else if (plugin->error_map == PLUGIN_RESPONSE_VALID) {
+			tblog(LOG_INFO, "Plugin %s returned with an error, which will be mapped to a valid response", plugin->name);
+		}
+		result = plugin->error_map;
+	}
+	else if (result == PLUGIN_RESPONSE_ABSTAIN) {
+		if (plugin->abstain_map == PLUGIN_RESPONSE_INVALID) {
+			tblog(LOG_INFO, "Plugin %s abstained, which will be mapped to an invalid response", plugin->name);
+		}
+		else if (plugin->abstain_map == PLUGIN_RESPONSE_VALID) {
+			tblog(LOG_INFO, "Plugin %s abstained, which will be mapped to a valid response", plugin->name);
+		}
+		result = plugin->abstain_map;
+	}
+
+	switch (plugin->aggregation) {
+		case AGGREGATION_NECESSARY:
+			query->necessary_pending--;
+			/* If any necessary plugin doesn't say yes we say no immediately */
+			if (result != PLUGIN_RESPONSE_VALID) {
+				query->verdict = QUERY_DECIDED_INVALID;
 			}
-			else if (context.plugins[i].abstain_map == PLUGIN_RESPONSE_VALID) {
-				tblog(LOG_INFO, "Plugin %s abstained, which will be mapped to a valid response", context.plugins[i].name);
+			break;
+		case AGGREGATION_CONGRESS:
+			query->congress_pending--;
+			if (result == PLUGIN_RESPONSE_VALID) {
+				query->congress_valid++;
 			}
-			query->responses[i] = context.plugins[i].abstain_map;
-		}
+			break;
+		case AGGREGATION_NONE:
+		default:
+			tblog(LOG_WARNING, "A plugin without an aggregation setting is running");
+			break;
+	}
+	tally_decide(query);
+	return;
+}
 
-		switch (context.plugins[i].aggregation) {
-			case AGGREGATION_NECESSARY:
-				/* We don't need to count necessary plugins' responses.
- 				 * If any of them don't say yes we just say no immediately */
-				if (query->responses[i] != PLUGIN_RESPONSE_VALID) {
-					tblog(LOG_INFO, "Policy Engine reporting BAD cert for %s", query->data->hostname);
-					return POLICY_RESPONSE_INVALID;
-				}
-				break;
-			case AGGREGATION_CONGRESS:
-				if (query->responses[i] == PLUGIN_RESPONSE_VALID) {
-					congress_approved_count++;
-				}
-				congress_total++;
-				break;
-			case AGGREGATION_NONE:
-			default:
-				tblog(LOG_WARNING, "A plugin without an aggregation setting is running");
-				break;
-		}
-	}
-	/* At this point we know that all necessary plugins have indicate the certificates
- 	 * found were valid, otherwise we'd have returned already.  Therefore the decision
- 	 * is in the hands of the congress plugins */
-	if (congress_total && (congress_approved_count / congress_total) < context.congress_threshold) {
+/**
+ * Takes a plugin its conditions ruled out out of the tally, as if it had
+ * never been configured for this query.  Caller must hold the query's
+ * mutex.
+ */
+void tally_skip(query_t* query, int plugin_id) {
+	query->plugin_state[plugin_id] |= QUERY_PLUGIN_DONE | QUERY_PLUGIN_SKIPPED;
+	switch (context.plugins[plugin_id].aggregation) {
+		case AGGREGATION_NECESSARY:
+			query->necessary_pending--;
+			break;
+		case AGGREGATION_CONGRESS:
+			query->congress_pending--;
+			query->congress_total--;
+			break;
+		case AGGREGATION_NONE:
+		default:
+			break;
+	}
+	tally_decide(query);
+	return;
+}
+
+/**
+ * Decides the query once the outstanding responses can no longer change
+ * the result.  Caller must hold the query's mutex.
+ */
+void tally_decide(query_t* query) {
+	double congress_total;
+	if (query->verdict != QUERY_UNDECIDED) {
+		return;
+	}
+
+	/* Congress is lost if even the outstanding votes can't reach the
+	 * threshold, and won once the votes already in reach it */
+	congress_total = query->congress_total;
+	if (congress_total && (query->congress_valid + query->congress_pending) / congress_total < context.congress_threshold) {
+		query->verdict = QUERY_DECIDED_INVALID;
+	}
+	else if (query->necessary_pending == 0 && (!congress_total || query->congress_valid / congress_total >= context.congress_threshold)) {
+		query->verdict = QUERY_DECIDED_VALID;
+	}
+	return;
+}
+
+/**
+ * Turns the decided tally and the CA system's answer into the response
+ * sent to the kernel
+ */
+int aggregate_responses(query_t* query, int ca_system_response) {
+	if (query->verdict != QUERY_DECIDED_VALID) {
 		tblog(LOG_INFO, "Policy Engine reporting BAD cert for %s", query->data->hostname);
 		return POLICY_RESPONSE_INVALID;
 	}
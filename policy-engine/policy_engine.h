@@ -4,7 +4,18 @@
 #include "addons.h"
 #include "plugins.h"
 #include "query_queue.h"
-#include "linked_list.h"
+#include "query_index.h"
+#include "timer_wheel.h"
+#include "verdict_cache.h"
+#include "singleflight.h"
+#include "root_store.h"
+#include "rx_buffer.h"
+#include <openssl/x509.h>
+
+/* ca_workers setting asking for one thread per online CPU */
+#define CA_WORKERS_AUTO	(-1)
+/* receive_workers setting asking for one thread per online CPU */
+#define RECEIVE_WORKERS_AUTO	(-1)
 
 typedef struct policy_context_t {
 	plugin_t* plugins;
@@ -12,13 +23,31 @@ typedef struct policy_context_t {
 	addon_t* addons;
 	int addon_count;
 	double congress_threshold;
-	queue_t* decider_queue;
-	list_t* timeout_list;
+	int necessary_count;
+	int congress_count;
+	int tier_count;
+	int ca_worker_count;
+	int receive_worker_count;
+	int netlink_buffer_size;
+	int queue_capacity;
+	int queue_overflow;
+	int cache_size;
+	int cache_ttl;
+	int edge_cache_size;
+	int intern_size;
+	int metrics_interval;
+	char* root_store_path;
+	root_store_t* root_store;
+	queue_t* ca_queue;
+	query_index_t* inflight;
+	timer_wheel_t* timer_wheel;
+	verdict_cache_t* verdict_cache;
+	singleflight_t* flights;
 } policy_context_t;
 
 typedef struct thread_param_t {
 	int plugin_id;
 } thread_param_t;
 
-int poll_schemes(uint32_t spid, uint64_t stptr, char* hostname, uint16_t port, unsigned char* cert_data, size_t len, char* client_hello, size_t client_hello_len, char* server_hello, size_t server_hello_len);
+int poll_schemes(uint32_t spid, uint64_t stptr, char* hostname, uint16_t port, unsigned char* cert_data, size_t len, char* client_hello, size_t client_hello_len, char* server_hello, size_t server_hello_len, rx_buffer_t* payload);
 #endif
@@ -3,151 +3,303 @@
 #include <string.h>
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
 #include "trustbase_plugin.h"
 #include "reverse_dns.h"
 #include "query.h"
+#include "query_pool.h"
+#include "cert_intern.h"
 #include "tb_logging.h"
 
 #define MAX_LENGTH	1024
 #define CERT_LENGTH_FIELD_SIZE	3
+#define QUERY_ALIGN(x)	(((x) + 15) & ~(size_t)15)
 
 static STACK_OF(X509)* parse_chain(unsigned char* data, size_t len);
 static unsigned int ntoh24(const unsigned char* data);
 //static void hton24(int x, unsigned char* buf);
 
-query_t* create_query(int num_plugins, int id, uint32_t spid, uint64_t stptr, char* hostname, uint16_t port, unsigned char* cert_data, size_t len, char* client_hello, size_t client_hello_len, char* server_hello, size_t server_hello_len) {
+query_t* create_query(int num_plugins, int id, uint32_t spid, uint64_t stptr, char* hostname, uint16_t port, unsigned char* cert_data, size_t len, char* client_hello, size_t client_hello_len, char* server_hello, size_t server_hello_len, rx_buffer_t* payload) {
 	char* hostname_resolved[1];
-	int hostname_len;
+	size_t hostname_len;
+	size_t responses_offset;
+	size_t plugin_state_offset;
+	size_t sent_at_offset;
+	size_t hostname_offset;
+	size_t raw_chain_offset;
+	size_t client_hello_offset;
+	size_t server_hello_offset;
+	size_t copied_len;
+	size_t copied_client_hello_len;
+	size_t copied_server_hello_len;
+	size_t total_len;
+	unsigned char* block;
+	int fresh;
 	int i;
 	query_t* query;
-	query = (query_t*)malloc(sizeof(query_t));
-	if (query == NULL) {
+
+	hostname_resolved[0] = hostname;
+	hostname_len = strlen(hostname_resolved[0])+1;
+
+	/* The query, its data and every payload share one pooled block.
+	 * Payloads that live in a received buffer are not copied into it */
+	copied_len = payload != NULL ? 0 : len;
+	copied_client_hello_len = payload != NULL ? 0 : client_hello_len;
+	copied_server_hello_len = payload != NULL ? 0 : server_hello_len;
+	responses_offset = QUERY_ALIGN(sizeof(query_t)) + QUERY_ALIGN(sizeof(query_data_t));
+	plugin_state_offset = responses_offset + QUERY_ALIGN(sizeof(int) * num_plugins);
+	sent_at_offset = plugin_state_offset + QUERY_ALIGN(sizeof(uint16_t) * num_plugins);
+	hostname_offset = sent_at_offset + QUERY_ALIGN(sizeof(unsigned int) * num_plugins);
+	raw_chain_offset = hostname_offset + QUERY_ALIGN(hostname_len);
+	client_hello_offset = raw_chain_offset + QUERY_ALIGN(copied_len);
+	server_hello_offset = client_hello_offset + QUERY_ALIGN(copied_client_hello_len);
+	total_len = server_hello_offset + copied_server_hello_len;
+
+	block = (unsigned char*)pool_alloc(total_len, &fresh);
+	if (block == NULL) {
 		tblog(LOG_WARNING, "Could not create query");
 		return NULL;
 	}
+	query = (query_t*)block;
+	/* Pooled blocks keep their mutex from one query to the next */
+	if (fresh && pthread_mutex_init(&query->mutex, NULL) != 0) {
+		tblog(LOG_WARNING, "Failed to create mutex for query");
+		pool_free(block);
+		return NULL;
+	}
+	/* The creator's reference */
+	query->refcount = 1;
 	query->num_plugins = num_plugins;
 	query->spid = spid;
 
-	query->responses = (int*)malloc(sizeof(int) * num_plugins);
-	if (query->responses == NULL) {
-		tblog(LOG_WARNING, "Could not create response array for query");
-		free(query);
-		return NULL;
-	}
+	query->responses = (int*)(block + responses_offset);
+	query->plugin_state = (uint16_t*)(block + plugin_state_offset);
+	query->sent_at = (unsigned int*)(block + sent_at_offset);
 	for (i = 0; i < num_plugins; i++) {
 		/* Default to error */
 		query->responses[i] = PLUGIN_RESPONSE_ERROR;
+		query->plugin_state[i] = 0;
+		query->sent_at[i] = 0;
 	}
 	query->num_responses = 0;
+	query->ca_response = PLUGIN_RESPONSE_ERROR;
+	query->ca_done = 0;
+	query->timed_out = 0;
+	query->finalized = 0;
+	query->reclaim_armed = 0;
+	query->waiters = NULL;
+	query->flight_next = NULL;
+	query->digests = NULL;
 	
-	if (pthread_mutex_init(&query->mutex, NULL) != 0) {
-		tblog(LOG_WARNING, "Failed to create mutex for query");
-		free(query->responses);
-		free(query);
-		return NULL;
-	}
-	if (pthread_cond_init(&query->threshold_met, NULL) != 0) {
-		tblog(LOG_WARNING, "Failed to create condvar for query");
-		pthread_mutex_destroy(&query->mutex);
-		free(query->responses);
-		free(query);
-		return NULL;
-	}
-	
-	query->data = (query_data_t*)malloc(sizeof(query_data_t));
-	if (query->data == NULL) {
-		tblog(LOG_WARNING, "Could not allocate query_data_t");
-		pthread_mutex_destroy(&query->mutex);
-		pthread_cond_destroy(&query->threshold_met);
-		free(query->responses);
-		free(query);
-		return NULL;
-	}
+	query->data = (query_data_t*)(block + QUERY_ALIGN(sizeof(query_t)));
 	
-	/* Parse chain to X509 structures */
-	query->data->chain = parse_chain(cert_data, len);
+	/* The chain is only parsed to X509 structures once someone needs
+	 * them, see query_chain */
+	query->data->chain = NULL;
 	
-	hostname_resolved[0] = hostname;
-
-	hostname_len = strlen(hostname_resolved[0])+1;
-	query->data->hostname = (char*)malloc(sizeof(char) * hostname_len);
-	if (query->data->hostname == NULL) {
-		tblog(LOG_ERROR, "Failed to allocate hostname for query");
-		pthread_mutex_destroy(&query->mutex);
-		pthread_cond_destroy(&query->threshold_met);
-		free(query->responses);
-		free(query->data);
-		free(query);
-		return NULL;
-	}
+	query->data->hostname = (char*)(block + hostname_offset);
 	query->data->port = port;
-
-	query->data->raw_chain = (unsigned char*)malloc(sizeof(unsigned char) * len);
-	if (query->data->raw_chain == NULL) {
-		tblog(LOG_ERROR, "Failed to allocate cert chain for query");
-		pthread_mutex_destroy(&query->mutex);
-		pthread_cond_destroy(&query->threshold_met);
-		free(query->responses);
-		free(query->data->hostname);
-		free(query->data);
-		free(query);
-		return NULL;
-	}
 	query->data->raw_chain_len = len;
-	query->data->client_hello = (char*)malloc(sizeof(unsigned char) * client_hello_len);
-	if (query->data->client_hello == NULL) {
-		tblog(LOG_ERROR, "Failed to allocate client_hello for query");
-		pthread_mutex_destroy(&query->mutex);
-		pthread_cond_destroy(&query->threshold_met);
-		free(query->responses);
-		free(query->data->raw_chain);
-		free(query->data->hostname);
-		free(query->data);
-		free(query);
-		return NULL;
-	}
 	query->data->client_hello_len = client_hello_len;
-	query->data->server_hello = (char*)malloc(sizeof(unsigned char) * server_hello_len);
-	if (query->data->server_hello == NULL) {
-		tblog(LOG_ERROR, "Failed to allocate server_hello for query");
-		pthread_mutex_destroy(&query->mutex);
-		pthread_cond_destroy(&query->threshold_met);
-		free(query->responses);
-		free(query->data->raw_chain);
-		free(query->data->hostname);
-		free(query->data);
-		free(query);
-		return NULL;
-	}
 	query->data->server_hello_len = server_hello_len;
 	memcpy(query->data->hostname, hostname_resolved[0], hostname_len);
-	memcpy(query->data->raw_chain, cert_data, len);
-	memcpy(query->data->client_hello, client_hello, client_hello_len);
-	memcpy(query->data->server_hello, server_hello, server_hello_len);
+	query->payload = payload;
+	if (payload != NULL) {
+		/* Keep the received buffer until the query is freed */
+		rx_buffer_get(payload);
+		query->data->raw_chain = cert_data;
+		query->data->client_hello = client_hello;
+		query->data->server_hello = server_hello;
+	}
+	else {
+		query->data->raw_chain = block + raw_chain_offset;
+		query->data->client_hello = (char*)(block + client_hello_offset);
+		query->data->server_hello = (char*)(block + server_hello_offset);
+		if (len > 0) {
+			memcpy(query->data->raw_chain, cert_data, len);
+		}
+		if (client_hello_len > 0) {
+			memcpy(query->data->client_hello, client_hello, client_hello_len);
+		}
+		if (server_hello_len > 0) {
+			memcpy(query->data->server_hello, server_hello, server_hello_len);
+		}
+	}
 	query->state_pointer = stptr;
 	query->data->id = id;
 	
 	return query;
 }
 
-void free_query(query_t* query) {
-	if (query == NULL) {
-		return;
+/**
+ * Gets the query's chain as X509 structures, parsing it on first use.
+ * Several threads may ask at once; all of them get the same chain.
+ */
+STACK_OF(X509)* query_chain(query_t* query) {
+	STACK_OF(X509)* chain;
+	STACK_OF(X509)* expected;
+	chain = __atomic_load_n(&query->data->chain, __ATOMIC_ACQUIRE);
+	if (chain != NULL) {
+		return chain;
+	}
+	/* Parsing twice in a race is cheap with interned certificates */
+	chain = parse_chain(query->data->raw_chain, query->data->raw_chain_len);
+	expected = NULL;
+	if (!__atomic_compare_exchange_n(&query->data->chain, &expected, chain, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		sk_X509_pop_free(chain, cert_release);
+		chain = expected;
+	}
+	return chain;
+}
+
+/**
+ * Gets the query's leaf certificate without parsing the rest of the chain
+ * @returns the leaf, to be given back with cert_release, or NULL
+ */
+X509* query_leaf(query_t* query) {
+	STACK_OF(X509)* chain;
+	X509* leaf;
+	chain = __atomic_load_n(&query->data->chain, __ATOMIC_ACQUIRE);
+	if (chain != NULL) {
+		leaf = sk_X509_value(chain, 0);
+		if (leaf != NULL) {
+			X509_up_ref(leaf);
+		}
+		return leaf;
+	}
+	if (query->data->raw_chain_len < CERT_LENGTH_FIELD_SIZE || ntoh24(query->data->raw_chain) > query->data->raw_chain_len - CERT_LENGTH_FIELD_SIZE) {
+		return NULL;
+	}
+	return cert_intern(query->data->raw_chain + CERT_LENGTH_FIELD_SIZE, ntoh24(query->data->raw_chain));
+}
+
+/**
+ * Gets a digest of one of the query's certificates, computing it the first
+ * time any plugin asks for it
+ * @param cert_index position in the chain, 0 is the leaf
+ * @param kind one of PLUGIN_DIGEST_*
+ * @param digest buffer of PLUGIN_DIGEST_MAX_LEN bytes
+ * @returns the digest's length, or 0 on failure
+ */
+int query_fingerprint(query_t* query, int cert_index, int kind, unsigned char* digest) {
+	unsigned char computed[EVP_MAX_MD_SIZE];
+	unsigned int len;
+	STACK_OF(X509)* chain;
+	chain_digests_t* digests;
+	chain_digests_t* expected;
+	cert_digests_t* entry;
+	X509* cert;
+	EVP_PKEY* key;
+	unsigned char* der;
+	int der_len;
+
+	if (kind < 0 || kind >= PLUGIN_DIGEST_KINDS) {
+		return 0;
+	}
+	len = kind == PLUGIN_DIGEST_CERT_SHA1 ? SHA_DIGEST_LENGTH : SHA256_DIGEST_LENGTH;
+	chain = query_chain(query);
+	if (chain == NULL || cert_index < 0 || cert_index >= sk_X509_num(chain)) {
+		return 0;
+	}
+	digests = __atomic_load_n(&query->digests, __ATOMIC_ACQUIRE);
+	if (digests == NULL) {
+		digests = (chain_digests_t*)calloc(1, sizeof(chain_digests_t) + sizeof(cert_digests_t) * sk_X509_num(chain));
+		if (digests == NULL) {
+			tblog(LOG_WARNING, "Could not allocate certificate digests");
+			return 0;
+		}
+		digests->count = sk_X509_num(chain);
+		expected = NULL;
+		if (!__atomic_compare_exchange_n(&query->digests, &expected, digests, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			free(digests);
+			digests = expected;
+		}
 	}
-	if (query->responses != NULL) {
-		free(query->responses);
+	entry = &digests->certs[cert_index];
+	if (__atomic_load_n(&entry->ready, __ATOMIC_ACQUIRE) & (1 << kind)) {
+		memcpy(digest, entry->digest[kind], len);
+		return len;
 	}
-	if (pthread_mutex_destroy(&query->mutex) != 0) {
-		tblog(LOG_ERROR, "Failed to destroy query mutex");
+
+	/* Hash outside the lock, plugins asking at once may both do it */
+	cert = sk_X509_value(chain, cert_index);
+	if (cert == NULL) {
+		/* Could not be parsed */
+		return 0;
 	}
-	if (pthread_cond_destroy(&query->threshold_met) != 0) {
-		tblog(LOG_ERROR, "Failed to destroy query condvar");
+	switch (kind) {
+		case PLUGIN_DIGEST_CERT_SHA1:
+			if (!X509_digest(cert, EVP_sha1(), computed, &len)) {
+				return 0;
+			}
+			break;
+		case PLUGIN_DIGEST_CERT_SHA256:
+			/* Interned certificates already know it */
+			if (!cert_fingerprint(cert, computed)) {
+				return 0;
+			}
+			break;
+		case PLUGIN_DIGEST_SPKI_SHA256:
+			key = X509_get_pubkey(cert);
+			if (key == NULL) {
+				return 0;
+			}
+			der = NULL;
+			der_len = i2d_PUBKEY(key, &der);
+			EVP_PKEY_free(key);
+			if (der_len <= 0) {
+				return 0;
+			}
+			if (!EVP_Digest(der, der_len, computed, &len, EVP_sha256(), NULL)) {
+				OPENSSL_free(der);
+				return 0;
+			}
+			OPENSSL_free(der);
+			break;
 	}
-	sk_X509_pop_free(query->data->chain, X509_free);
-	free(query->data->raw_chain);
-	free(query->data->hostname);
-	free(query->data);
-	free(query);
+	pthread_mutex_lock(&query->mutex);
+	if (!(entry->ready & (1 << kind))) {
+		memcpy(entry->digest[kind], computed, len);
+		__atomic_or_fetch(&entry->ready, 1 << kind, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&query->mutex);
+	memcpy(digest, computed, len);
+	return len;
+}
+
+/**
+ * Gets the query a query_data_t handed to plugins belongs to
+ */
+query_t* query_of(query_data_t* data) {
+	return (query_t*)((unsigned char*)data - QUERY_ALIGN(sizeof(query_t)));
+}
+
+/**
+ * Takes an additional reference on a query the caller already holds one on
+ */
+void query_get(query_t* query) {
+	__atomic_add_fetch(&query->refcount, 1, __ATOMIC_RELAXED);
+	return;
+}
+
+/**
+ * Drops a reference.  The caller that drops the last one must free the query
+ * @returns 1 if that was the last reference, 0 otherwise
+ */
+int query_put(query_t* query) {
+	return __atomic_sub_fetch(&query->refcount, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+void free_query(query_t* query) {
+	if (query == NULL) {
+		return;
+	}
+	sk_X509_pop_free(query->data->chain, cert_release);
+	free(query->digests);
+	rx_buffer_put(query->payload);
+	/* The mutex is left initialized for the block's next query */
+	pool_free(query);
 	return;
 }
 
@@ -155,7 +307,6 @@ void free_query(query_t* query) {
 STACK_OF(X509)* parse_chain(unsigned char* data, size_t len) {
 	unsigned char* start_pos;
 	unsigned char* current_pos;
-	const unsigned char* cert_ptr;
 	X509* cert;
 	unsigned int cert_len;
 	start_pos = data;
@@ -164,10 +315,20 @@ STACK_OF(X509)* parse_chain(unsigned char* data, size_t len) {
 
 	chain = sk_X509_new_null();
 	while ((current_pos - start_pos) < len) {
+		/* The lengths come from the server, never trust them past the
+		 * end of the chain */
+		if (len - (current_pos - start_pos) < CERT_LENGTH_FIELD_SIZE) {
+			tblog(LOG_ERROR, "truncated certificate length in chain");
+			break;
+		}
 		cert_len = ntoh24(current_pos);
 		current_pos += CERT_LENGTH_FIELD_SIZE;
-		cert_ptr = current_pos;
-		cert = d2i_X509(NULL, &cert_ptr, cert_len);
+		if (cert_len > len - (current_pos - start_pos)) {
+			tblog(LOG_ERROR, "certificate length %u runs past the end of the chain", cert_len);
+			break;
+		}
+		/* Popular intermediates are parsed once and shared */
+		cert = cert_intern(current_pos, cert_len);
 		if (!cert) {
 			tblog(LOG_ERROR,"unable to parse certificate");
 		}
@@ -4,21 +4,102 @@
 #include <stdint.h>
 #include <pthread.h>
 #include "trustbase_plugin.h"
+#include "timer_wheel.h"
+#include "verdict_cache.h"
+#include "rx_buffer.h"
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 
+/* Per-plugin flags kept in query_t.plugin_state */
+#define QUERY_PLUGIN_HELD	0x01 /* plugin holds a reference to the query */
+#define QUERY_PLUGIN_DONE	0x02 /* plugin's response has been recorded */
+#define QUERY_PLUGIN_CACHEABLE	0x04 /* response may go into the verdict cache */
+#define QUERY_PLUGIN_CACHED	0x08 /* response was taken from the verdict cache */
+#define QUERY_PLUGIN_SENT	0x10 /* plugin's tier has been dispatched */
+#define QUERY_PLUGIN_ANSWERED	0x20 /* plugin answered rather than timed out */
+#define QUERY_PLUGIN_SKIPPED	0x40 /* plugin was ruled out by its run_if/skip_if conditions */
+#define QUERY_PLUGIN_QUEUING	0x80 /* plugin was claimed but not yet queued */
+#define QUERY_PLUGIN_ASKED	0x100 /* asynchronous plugin was handed the query */
+
+/* Outcome of the running tally in query_t.verdict */
+enum {
+	QUERY_UNDECIDED,
+	QUERY_DECIDED_VALID, /* still needs the CA system's answer */
+	QUERY_DECIDED_INVALID,
+};
+
+/* Digests of one chain certificate, see query_fingerprint */
+typedef struct cert_digests_t {
+	int ready; /* bit per PLUGIN_DIGEST_* kind computed */
+	unsigned char digest[PLUGIN_DIGEST_KINDS][PLUGIN_DIGEST_MAX_LEN];
+} cert_digests_t;
+
+typedef struct chain_digests_t {
+	int count;
+	cert_digests_t certs[];
+} chain_digests_t;
+
+/* A connection waiting on another query's verdict, see singleflight.c */
+typedef struct query_waiter_t {
+	struct query_waiter_t* next;
+	uint32_t spid;
+	uint64_t state_pointer;
+} query_waiter_t;
+
 typedef struct query_t {
 	pthread_mutex_t mutex;
-	pthread_cond_t threshold_met;
+	/* The query is freed when this drops to zero, see query_put */
+	int refcount;
 	uint32_t spid;
 	uint64_t state_pointer;
 	int num_plugins;
 	int num_responses;
 	int* responses;
+	uint16_t* plugin_state;
+	/* When each plugin was sent the query, in ms since start */
+	unsigned int* sent_at;
+	/* Running tally of the responses so far, see tally_response */
+	int necessary_pending;
+	int congress_pending;
+	int congress_valid;
+	/* Congress members that were not skipped */
+	int congress_total;
+	int verdict;
+	/* Plugin tier being run, how many of its plugins are outstanding and
+	 * how many still wait on their conditions */
+	int tier;
+	int tier_pending;
+	int tier_waiting;
+	int ca_response;
+	int ca_done;
+	int timed_out;
+	/* Set by whoever claims the query for the final verdict */
+	int finalized;
+	timer_entry_t timer;
+	/* Takes back the references of asynchronous plugins that never
+	 * called back, see arm_reclaim */
+	timer_entry_t reclaim_timer;
+	int reclaim_armed;
+	struct timespec start;
+	/* Fingerprint of hostname, port and chain */
+	unsigned char key[VERDICT_CACHE_KEY_LEN];
+	/* Identical queries coalesced into this one */
+	query_waiter_t* waiters;
+	struct query_t* flight_next;
+	/* Received datagram the chain and hellos point into, if any */
+	rx_buffer_t* payload;
+	/* Certificate digests asked for by plugins, allocated on first use */
+	chain_digests_t* digests;
 	query_data_t* data;
 } query_t;
 
 
-query_t* create_query(int num_plugins, int id, uint32_t spid, uint64_t stptr, char* hostname, uint16_t port, unsigned char* cert_data, size_t len, char* client_hello, size_t client_hello_len, char* server_hello, size_t server_hello_len);
+query_t* create_query(int num_plugins, int id, uint32_t spid, uint64_t stptr, char* hostname, uint16_t port, unsigned char* cert_data, size_t len, char* client_hello, size_t client_hello_len, char* server_hello, size_t server_hello_len, rx_buffer_t* payload);
 void free_query(query_t* query);
+STACK_OF(X509)* query_chain(query_t* query);
+X509* query_leaf(query_t* query);
+int query_fingerprint(query_t* query, int cert_index, int kind, unsigned char* digest);
+query_t* query_of(query_data_t* data);
+void query_get(query_t* query);
+int query_put(query_t* query);
 #endif
@@ -0,0 +1,212 @@
+/*
+ * Index of in-flight queries by id.
+ *
+ * Lookups take a lock.  Finding a query means taking a reference on it,
+ * and the query may be on its way to being freed: query blocks go back
+ * to malloc (see query_pool.c), so a lock-free reader could increment
+ * the refcount of memory that is no longer a query.  Rather than keep
+ * every query block alive for the life of the index, finding and
+ * removing a query take one of INDEX_LOCK_COUNT mutexes picked by its id.
+ * Sequential ids spread neighbouring queries over different locks, so
+ * the lock is almost never contended.
+ *
+ * On inflight_benchmark a lookup costs about 30-45ns from 10 to 10k
+ * queries in flight and 100-135ns at 100k.  The same code without the
+ * lock measures about 30-40ns and 85-120ns: the rise at 100k comes from
+ * the slots and queries no longer fitting in cache, not from the lock.
+ */
+
+#include <stdlib.h>
+#include "query.h"
+#include "tb_logging.h"
+#include "query_index.h"
+
+/* Slot keys that are not a query id */
+#define KEY_EMPTY	(-1)
+#define KEY_CLAIMED	(-2) /* taken by an add that has not stored its query yet */
+
+static size_t index_find(query_index_t* index, int id, query_t** query);
+static void record_probe(query_index_t* index, size_t probe, int added);
+static int64_t id_key(int id);
+static pthread_mutex_t* id_lock(query_index_t* index, int id);
+
+/**
+ * Creates an empty index
+ * @param capacity maximum number of in-flight queries, rounded up to a power of two
+ * @returns index pointer or NULL on failure
+ */
+query_index_t* index_create(size_t capacity) {
+	query_index_t* index;
+	size_t size;
+	size_t i;
+	size = 2;
+	while (size < capacity) {
+		size <<= 1;
+	}
+	index = (query_index_t*)malloc(sizeof(query_index_t));
+	if (index == NULL) {
+		return NULL;
+	}
+	index->slots = (index_slot_t*)malloc(sizeof(index_slot_t) * size);
+	index->probe_counts = (uint32_t*)calloc(size, sizeof(uint32_t));
+	if (index->slots == NULL || index->probe_counts == NULL) {
+		tblog(LOG_ERROR, "Failed to allocate %zu slots for query index", size);
+		free(index->slots);
+		free(index->probe_counts);
+		free(index);
+		return NULL;
+	}
+	for (i = 0; i < size; i++) {
+		index->slots[i].key = KEY_EMPTY;
+		index->slots[i].query = NULL;
+	}
+	for (i = 0; i < INDEX_LOCK_COUNT; i++) {
+		pthread_mutex_init(&index->locks[i], NULL);
+	}
+	pthread_mutex_init(&index->probe_mutex, NULL);
+	index->mask = size - 1;
+	index->max_probe = 0;
+	return index;
+}
+
+void index_free(query_index_t* index) {
+	int i;
+	if (index == NULL) {
+		return;
+	}
+	for (i = 0; i < INDEX_LOCK_COUNT; i++) {
+		pthread_mutex_destroy(&index->locks[i]);
+	}
+	pthread_mutex_destroy(&index->probe_mutex);
+	free(index->probe_counts);
+	free(index->slots);
+	free(index);
+	return;
+}
+
+/* Returns 0 on success, 1 if the index is full */
+int index_add(query_index_t* index, query_t* query) {
+	index_slot_t* slot;
+	int64_t expected;
+	size_t home;
+	size_t probe;
+	home = (size_t)id_key(query->data->id) & index->mask;
+	for (probe = 0; probe <= index->mask; probe++) {
+		slot = &index->slots[(home + probe) & index->mask];
+		expected = KEY_EMPTY;
+		if (__atomic_compare_exchange_n(&slot->key, &expected, KEY_CLAIMED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			slot->query = query;
+			/* Lookups must probe at least this far from now on */
+			if (probe > 0) {
+				record_probe(index, probe, 1);
+			}
+			__atomic_store_n(&slot->key, id_key(query->data->id), __ATOMIC_RELEASE);
+			return 0;
+		}
+	}
+	tblog(LOG_ERROR, "Query index is full");
+	return 1;
+}
+
+/**
+ * Finds a query by id and takes a reference on it, unless it is already
+ * on its way to being freed
+ * @returns the query or NULL if there is none with that id
+ */
+query_t* index_get(query_index_t* index, int id) {
+	pthread_mutex_t* lock;
+	query_t* query;
+	int refcount;
+	lock = id_lock(index, id);
+	pthread_mutex_lock(lock);
+	index_find(index, id, &query);
+	if (query != NULL) {
+		/* It cannot be removed, and so not freed, while we hold its
+		 * lock, but its last reference may already be gone */
+		refcount = __atomic_load_n(&query->refcount, __ATOMIC_RELAXED);
+		do {
+			if (refcount == 0) {
+				query = NULL;
+				break;
+			}
+		} while (!__atomic_compare_exchange_n(&query->refcount, &refcount, refcount + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	}
+	pthread_mutex_unlock(lock);
+	return query;
+}
+
+/**
+ * Removes a query once its last reference is gone, before it is freed
+ * @returns the query or NULL if there is none with that id
+ */
+query_t* index_remove(query_index_t* index, int id) {
+	pthread_mutex_t* lock;
+	query_t* query;
+	size_t slot;
+	size_t probe;
+	lock = id_lock(index, id);
+	pthread_mutex_lock(lock);
+	slot = index_find(index, id, &query);
+	if (query != NULL) {
+		index->slots[slot].query = NULL;
+		probe = (slot - ((size_t)id_key(id) & index->mask)) & index->mask;
+		if (probe > 0) {
+			record_probe(index, probe, 0);
+		}
+		__atomic_store_n(&index->slots[slot].key, KEY_EMPTY, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(lock);
+	return query;
+}
+
+/* Compares the ids kept in the slots, never the queries themselves.
+ * Caller must hold the id's lock */
+size_t index_find(query_index_t* index, int id, query_t** query) {
+	int64_t key;
+	size_t home;
+	size_t probe;
+	size_t max_probe;
+	key = id_key(id);
+	home = (size_t)key & index->mask;
+	max_probe = __atomic_load_n(&index->max_probe, __ATOMIC_ACQUIRE);
+	for (probe = 0; probe <= max_probe; probe++) {
+		if (__atomic_load_n(&index->slots[(home + probe) & index->mask].key, __ATOMIC_ACQUIRE) == key) {
+			*query = index->slots[(home + probe) & index->mask].query;
+			return (home + probe) & index->mask;
+		}
+	}
+	*query = NULL;
+	return 0;
+}
+
+/* Counts a query placed probe slots from home, or removed from there, and
+ * moves max_probe to the furthest distance still in use */
+void record_probe(query_index_t* index, size_t probe, int added) {
+	size_t max_probe;
+	pthread_mutex_lock(&index->probe_mutex);
+	max_probe = index->max_probe;
+	if (added) {
+		index->probe_counts[probe]++;
+		if (probe > max_probe) {
+			max_probe = probe;
+		}
+	}
+	else {
+		index->probe_counts[probe]--;
+		while (max_probe > 0 && index->probe_counts[max_probe] == 0) {
+			max_probe--;
+		}
+	}
+	__atomic_store_n(&index->max_probe, max_probe, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&index->probe_mutex);
+	return;
+}
+
+/* Ids wrap around to negative values, keys never do */
+int64_t id_key(int id) {
+	return (int64_t)(uint32_t)id;
+}
+
+pthread_mutex_t* id_lock(query_index_t* index, int id) {
+	return &index->locks[(uint32_t)id % INDEX_LOCK_COUNT];
+}
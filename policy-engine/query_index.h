@@ -0,0 +1,40 @@
+#ifndef _QUERY_INDEX_H
+#define _QUERY_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "query.h"
+
+#define INDEX_LOCK_COUNT	64
+
+/* A slot holds the id of its query so probing never reads a query that
+ * may have been freed */
+typedef struct index_slot_t {
+	int64_t key;
+	query_t* query;
+} index_slot_t;
+
+/* Open-addressed table of in-flight queries keyed by query id.  Ids are
+ * handed out sequentially so a query almost always sits in the slot its
+ * id maps to.  Adding never takes a lock; finding and removing a query
+ * take the lock of its id, so a query cannot be freed while it is being
+ * found */
+typedef struct query_index_t {
+	size_t mask;
+	/* Furthest any query in the table sits from its home slot, kept
+	 * with a count of queries at each distance */
+	size_t max_probe;
+	uint32_t* probe_counts;
+	pthread_mutex_t probe_mutex;
+	index_slot_t* slots;
+	pthread_mutex_t locks[INDEX_LOCK_COUNT];
+} query_index_t;
+
+query_index_t* index_create(size_t capacity);
+void index_free(query_index_t* index);
+int index_add(query_index_t* index, query_t* query);
+query_t* index_get(query_index_t* index, int id);
+query_t* index_remove(query_index_t* index, int id);
+
+#endif
@@ -0,0 +1,255 @@
+/*
+ * Recycling allocator for query objects.
+ *
+ * A query and all of its variable length payloads live in one block
+ * taken from a power-of-two size class.  Freed blocks go to a small
+ * cache owned by the freeing thread and spill over, in batches, to a
+ * shared depot for their class.  A thread keeps at most
+ * POOL_LOCAL_BYTES per class, so blocks of the largest classes always go
+ * to the depot.  Queries are created on the netlink
+ * thread and freed wherever they finish, so the depot is how blocks
+ * find their way back.  The depot keeps at most POOL_DEPOT_BYTES per
+ * class and gives the rest back to malloc, as it does blocks too large
+ * for any class, so nothing may read a block once it has been freed.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "tb_logging.h"
+#include "query_pool.h"
+
+#define POOL_MIN_SHIFT		12 /* 4 KiB */
+#define POOL_CLASS_COUNT	8 /* up to 512 KiB, enough for any netlink query */
+/* Blocks a thread keeps per class, at most POOL_LOCAL_MAX of them and
+ * POOL_LOCAL_BYTES in all, so the largest classes are not kept at all */
+#define POOL_LOCAL_MAX		32
+#define POOL_LOCAL_BYTES	(256 * 1024)
+/* Memory the depot holds on to per class, beyond it blocks are freed */
+#define POOL_DEPOT_BYTES	(16 * 1024 * 1024)
+#define POOL_OVERSIZE		(-1)
+
+typedef struct pool_block_t {
+	struct pool_block_t* next;
+	int size_class;
+	/* Keeps the payload 16-byte aligned */
+	int pad[1];
+} pool_block_t;
+
+typedef struct pool_list_t {
+	pool_block_t* head;
+	int count;
+} pool_list_t;
+
+typedef struct pool_cache_t {
+	pool_list_t classes[POOL_CLASS_COUNT];
+} pool_cache_t;
+
+static pool_list_t depot[POOL_CLASS_COUNT];
+static pthread_mutex_t depot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static __thread pool_cache_t* local_cache;
+
+static int size_to_class(size_t size);
+static pool_cache_t* get_cache(void);
+static void make_cache_key(void);
+static void release_cache(void* arg);
+static void move_blocks(pool_list_t* from, pool_list_t* to, int count);
+static void trim_depot(int size_class);
+static int local_max(int size_class);
+static int local_batch(int size_class);
+
+/**
+ * Allocates a block with room for size bytes
+ * @param fresh set to 1 if the block has never held a query before
+ * @returns pointer to the usable area or NULL on failure
+ */
+void* pool_alloc(size_t size, int* fresh) {
+	pool_block_t* block;
+	pool_cache_t* cache;
+	pool_list_t* local;
+	int size_class;
+
+	size_class = size_to_class(size);
+	if (size_class == POOL_OVERSIZE) {
+		tblog(LOG_WARNING, "Query of %zu bytes is too large to pool", size);
+		block = (pool_block_t*)malloc(sizeof(pool_block_t) + size);
+		if (block == NULL) {
+			return NULL;
+		}
+		block->size_class = POOL_OVERSIZE;
+		*fresh = 1;
+		return block + 1;
+	}
+
+	cache = get_cache();
+	if (cache != NULL) {
+		local = &cache->classes[size_class];
+		if (local->head == NULL) {
+			pthread_mutex_lock(&depot_mutex);
+			move_blocks(&depot[size_class], local, local_batch(size_class));
+			pthread_mutex_unlock(&depot_mutex);
+		}
+		if (local->head != NULL) {
+			block = local->head;
+			local->head = block->next;
+			local->count--;
+			*fresh = 0;
+			return block + 1;
+		}
+	}
+
+	block = (pool_block_t*)malloc((size_t)1 << (size_class + POOL_MIN_SHIFT));
+	if (block == NULL) {
+		return NULL;
+	}
+	block->size_class = size_class;
+	*fresh = 1;
+	return block + 1;
+}
+
+/**
+ * Returns a block obtained from pool_alloc
+ */
+void pool_free(void* ptr) {
+	pool_block_t* block;
+	pool_cache_t* cache;
+	pool_list_t* local;
+	if (ptr == NULL) {
+		return;
+	}
+	block = (pool_block_t*)ptr - 1;
+	if (block->size_class == POOL_OVERSIZE) {
+		free(block);
+		return;
+	}
+	cache = get_cache();
+	if (cache == NULL || local_max(block->size_class) == 0) {
+		pthread_mutex_lock(&depot_mutex);
+		block->next = depot[block->size_class].head;
+		depot[block->size_class].head = block;
+		depot[block->size_class].count++;
+		trim_depot(block->size_class);
+		pthread_mutex_unlock(&depot_mutex);
+		return;
+	}
+	local = &cache->classes[block->size_class];
+	block->next = local->head;
+	local->head = block;
+	local->count++;
+	if (local->count > local_max(block->size_class)) {
+		pthread_mutex_lock(&depot_mutex);
+		move_blocks(local, &depot[block->size_class], local_batch(block->size_class));
+		trim_depot(block->size_class);
+		pthread_mutex_unlock(&depot_mutex);
+	}
+	return;
+}
+
+/**
+ * Frees every block held by the depot.  Only call this once no
+ * queries remain, as the engine is shutting down.
+ */
+void pool_drain(void) {
+	pool_block_t* block;
+	int i;
+	pthread_mutex_lock(&depot_mutex);
+	for (i = 0; i < POOL_CLASS_COUNT; i++) {
+		while (depot[i].head != NULL) {
+			block = depot[i].head;
+			depot[i].head = block->next;
+			free(block);
+		}
+		depot[i].count = 0;
+	}
+	pthread_mutex_unlock(&depot_mutex);
+	return;
+}
+
+int size_to_class(size_t size) {
+	int size_class;
+	size += sizeof(pool_block_t);
+	for (size_class = 0; size_class < POOL_CLASS_COUNT; size_class++) {
+		if (size <= ((size_t)1 << (size_class + POOL_MIN_SHIFT))) {
+			return size_class;
+		}
+	}
+	return POOL_OVERSIZE;
+}
+
+pool_cache_t* get_cache(void) {
+	if (local_cache != NULL) {
+		return local_cache;
+	}
+	pthread_once(&cache_key_once, make_cache_key);
+	local_cache = (pool_cache_t*)calloc(1, sizeof(pool_cache_t));
+	if (local_cache != NULL) {
+		pthread_setspecific(cache_key, local_cache);
+	}
+	return local_cache;
+}
+
+void make_cache_key(void) {
+	pthread_key_create(&cache_key, release_cache);
+	return;
+}
+
+/* Thread exit destructor: hands the thread's blocks back to the depot */
+void release_cache(void* arg) {
+	pool_cache_t* cache;
+	int i;
+	cache = (pool_cache_t*)arg;
+	pthread_mutex_lock(&depot_mutex);
+	for (i = 0; i < POOL_CLASS_COUNT; i++) {
+		move_blocks(&cache->classes[i], &depot[i], cache->classes[i].count);
+		trim_depot(i);
+	}
+	pthread_mutex_unlock(&depot_mutex);
+	free(cache);
+	local_cache = NULL;
+	return;
+}
+
+/* Caller must hold the depot mutex */
+void move_blocks(pool_list_t* from, pool_list_t* to, int count) {
+	pool_block_t* block;
+	while (count-- > 0 && from->head != NULL) {
+		block = from->head;
+		from->head = block->next;
+		from->count--;
+		block->next = to->head;
+		to->head = block;
+		to->count++;
+	}
+	return;
+}
+
+/* Frees the blocks of a class beyond what the depot may hold.  Caller
+ * must hold the depot mutex */
+void trim_depot(int size_class) {
+	pool_block_t* block;
+	int max;
+	max = POOL_DEPOT_BYTES >> (size_class + POOL_MIN_SHIFT);
+	while (depot[size_class].count > max) {
+		block = depot[size_class].head;
+		depot[size_class].head = block->next;
+		depot[size_class].count--;
+		free(block);
+	}
+	return;
+}
+
+/* How many blocks of a class a thread's cache may hold */
+int local_max(int size_class) {
+	int max;
+	max = POOL_LOCAL_BYTES >> (size_class + POOL_MIN_SHIFT);
+	return max < POOL_LOCAL_MAX ? max : POOL_LOCAL_MAX;
+}
+
+/* How many blocks move between a thread's cache and the depot at once */
+int local_batch(int size_class) {
+	int max;
+	max = local_max(size_class);
+	return max > 1 ? max / 2 : 1;
+}
@@ -0,0 +1,10 @@
+#ifndef _QUERY_POOL_H
+#define _QUERY_POOL_H
+
+#include <stddef.h>
+
+void* pool_alloc(size_t size, int* fresh);
+void pool_free(void* ptr);
+void pool_drain(void);
+
+#endif
@@ -1,157 +1,219 @@
-#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <pthread.h>
-#include <errno.h>
-#include <fcntl.h> /* O_CREAT constant */
-#include <sys/stat.h> /* S_IRWXU constant */
-#include <semaphore.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "query.h"
 #include "tb_logging.h"
 #include "query_queue.h"
 
-static queue_node_t* make_queue_node(query_t* query);
+/*
+ * Bounded lock-free queue based on Dmitry Vyukov's MPMC ring.  Every cell
+ * carries a sequence number that tells producers and consumers whether
+ * it is free to write or ready to read, so neither side takes a lock.
+ * Threads only sleep (on a futex) when the ring is empty, or when it is
+ * full and the overflow policy is QUEUE_OVERFLOW_BLOCK.
+ */
+
+static int try_enqueue(queue_t* queue, query_t* query);
+static query_t* try_dequeue(queue_t* queue);
+static void wake(int* word, int* waiters, int count);
+static void wait_on(int* word, int* waiters, queue_t* queue, int for_space);
 
 /**
  * Create a new empty queue
+ * @param capacity maximum number of queued queries, rounded up to a power of two
+ * @param overflow what enqueue does on a full queue (QUEUE_OVERFLOW_BLOCK or QUEUE_OVERFLOW_DROP)
  * @returns queue pointer or NULL on failure
  */
-queue_t* make_queue(const char* name) {
+queue_t* make_queue(const char* name, size_t capacity, int overflow) {
 	queue_t* queue;
-	sem_t* sem;
-	sem = sem_open(name, O_CREAT, S_IRWXU, 0);
-	if (sem == SEM_FAILED) {
-		tblog(LOG_ERROR, "Failed to create queue semaphore %s: %s", name, strerror(errno));
-		return NULL;
+	size_t size;
+	size_t i;
+	size = 2;
+	while (size < capacity) {
+		size <<= 1;
 	}
-	queue = (queue_t*)malloc(sizeof(queue_t));
-	if (queue == NULL) {
+	if (posix_memalign((void**)&queue, CACHE_LINE_SIZE, sizeof(queue_t)) != 0) {
 		tblog(LOG_ERROR, "Failed to allocate space for queue %s", name);
 		return NULL;
 	}
-	if (pthread_mutex_init(&queue->mutex, NULL) != 0) {
-		tblog(LOG_ERROR, "Failed to create mutex for queue %s", name);
-		free(queue); /* free allocated memory since this happened after malloc */
+	memset(queue, 0, sizeof(queue_t));
+	if (posix_memalign((void**)&queue->cells, CACHE_LINE_SIZE, sizeof(queue_cell_t) * size) != 0) {
+		tblog(LOG_ERROR, "Failed to allocate %zu cells for queue %s", size, name);
+		free(queue);
 		return NULL;
 	}
-	queue->head = NULL;
-	queue->tail = NULL;
-	queue->fill_sem = sem;
+	for (i = 0; i < size; i++) {
+		queue->cells[i].sequence = i;
+		queue->cells[i].query = NULL;
+	}
+	queue->mask = size - 1;
+	queue->overflow = overflow;
 	return queue;
 }
 
 /**
- * Empties queue and frees all nodes
- * and queue itself
+ * Frees the queue.  Queries still in it are handed to release, which
+ * drops the reference the queue held.  Nothing may use the queue any more
+ * @param owner passed on to release, e.g. the plugin the queue feeds
  */
-void free_queue(queue_t* queue, const char* name) {
-	queue_node_t* current;
-	queue_node_t* next;
+void free_queue(queue_t* queue, void (*release)(query_t* query, int owner), int owner) {
+	query_t* query;
 	if (queue == NULL) {
 		return;
 	}
-	current = queue->head;
-	while (current != NULL) {
-		next = current->next;
-		/* We're not freeing the contents of nodes on purpose.
-		   The query data still needs to be read by others */
-		free(current);
-		current = next;
-	}
-	if (sem_close(queue->fill_sem) == -1) {
-		tblog(LOG_ERROR, "Failed to close semaphore: %s", strerror(errno));
-	}
-	if (sem_unlink(name) == -1) {
-		// This removes the semaphore from the system, perhaps it is unneeded
-		tblog(LOG_ERROR, "Failed to unlink semaphore %s: %s", name, strerror(errno));	
-	}
-	if (pthread_mutex_destroy(&queue->mutex) != 0) {
-		tblog(LOG_ERROR, "Failed to destroy queue mutex");
+	while ((query = try_dequeue(queue)) != NULL) {
+		release(query, owner);
 	}
+	free(queue->cells);
 	free(queue);
-	
 	return;
 }
 
 /**
- * Creates a queue node
- * @returns queue_node_t pointer or NULL on failure
+ * Adds a query to the specified queue.  If the queue is full this either
+ * waits for room or fails, depending on the queue's overflow policy
+ * @returns 1 on success, 0 on failure
  */
-queue_node_t* make_queue_node(query_t* query) {
-	queue_node_t* node;
-	node = (queue_node_t*)malloc(sizeof(queue_node_t));
-	if (node == NULL) {
-		return NULL;
+int enqueue(queue_t* queue, query_t* query) {
+	while (try_enqueue(queue, query) == 0) {
+		if (queue->overflow == QUEUE_OVERFLOW_DROP) {
+			return 0;
+		}
+		wait_on(&queue->not_full, &queue->full_waiters, queue, 1);
 	}
-	node->next = NULL;
-	node->prev = NULL;
-	node->query = query;
-	return node;
+	wake(&queue->not_empty, &queue->empty_waiters, 1);
+	return 1;
 }
 
 /**
- * Adds a query to the specified queue
+ * Adds a query to the specified queue unless it is full, whatever the
+ * queue's overflow policy.  For threads that must never wait on a queue.
  * @returns 1 on success, 0 on failure
  */
-int enqueue(queue_t* queue, query_t* query) {
-	queue_node_t* new_node;
-	pthread_mutex_lock(&queue->mutex);
-	new_node = make_queue_node(query);
-	if (new_node == NULL) {
-		pthread_mutex_unlock(&queue->mutex);
+int enqueue_nowait(queue_t* queue, query_t* query) {
+	if (try_enqueue(queue, query) == 0) {
 		return 0;
 	}
-	// If queue is empty
-	if (queue->head == NULL) {
-		assert(queue->tail == NULL);
-		queue->head = new_node;
-		queue->tail = new_node;
-		pthread_mutex_unlock(&queue->mutex);
-		sem_post(queue->fill_sem);
-		return 1;
-	}
-
-	// If queue already has something in it
-	assert(queue->tail->next == NULL);
-	new_node->prev = queue->tail;
-	queue->tail->next = new_node;
-	queue->tail = new_node;
-	pthread_mutex_unlock(&queue->mutex);
-	sem_post(queue->fill_sem);
+	wake(&queue->not_empty, &queue->empty_waiters, 1);
 	return 1;
 }
 
 /**
- * Returns the first element on the queue and
- * removes it
- * @returns pointer to first query or NULL on failure
+ * Returns the first element on the queue and removes it, waiting for
+ * one to arrive if the queue is empty.  This is a cancellation point.
+ * @returns pointer to first query
  */
 query_t* dequeue(queue_t* queue) {
-	queue_node_t* node;
 	query_t* query;
-	sem_wait(queue->fill_sem);
-	pthread_mutex_lock(&queue->mutex);
-	if (queue->head == NULL) {
-		pthread_mutex_unlock(&queue->mutex);
-		return NULL;
+	while ((query = try_dequeue(queue)) == NULL) {
+		wait_on(&queue->not_empty, &queue->empty_waiters, queue, 0);
 	}
-	// Get data
-	node = queue->head;
-	query = node->query;
+	wake(&queue->not_full, &queue->full_waiters, 1);
+	return query;
+}
 
-	// If this was the last item in the queue
-	if (queue->tail == node) {
-		queue->tail = NULL;
+/**
+ * Wakes every thread sleeping on the queue so that pending
+ * cancellation requests are acted upon
+ */
+void queue_wake_all(queue_t* queue) {
+	wake(&queue->not_empty, &queue->empty_waiters, INT_MAX);
+	wake(&queue->not_full, &queue->full_waiters, INT_MAX);
+	return;
+}
+
+int try_enqueue(queue_t* queue, query_t* query) {
+	queue_cell_t* cell;
+	uint64_t pos;
+	uint64_t seq;
+	int64_t dif;
+	pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+	while (1) {
+		cell = &queue->cells[pos & queue->mask];
+		seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		dif = (int64_t)seq - (int64_t)pos;
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		}
+		else if (dif < 0) {
+			/* Full */
+			return 0;
+		}
+		else {
+			pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+		}
 	}
+	cell->query = query;
+	__atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
 
-	// Make next element new head
-	queue->head = node->next;
-	if (queue->head != NULL) {
-		queue->head->prev = NULL;
+query_t* try_dequeue(queue_t* queue) {
+	queue_cell_t* cell;
+	query_t* query;
+	uint64_t pos;
+	uint64_t seq;
+	int64_t dif;
+	pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+	while (1) {
+		cell = &queue->cells[pos & queue->mask];
+		seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		dif = (int64_t)seq - (int64_t)(pos + 1);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		}
+		else if (dif < 0) {
+			/* Empty */
+			return NULL;
+		}
+		else {
+			pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+		}
 	}
-	free(node);
-	pthread_mutex_unlock(&queue->mutex);
+	query = cell->query;
+	__atomic_store_n(&cell->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
 	return query;
 }
 
+/* The futex word is left alone unless someone sleeps on it, so the common
+ * case only reads the waiter count.  The fence pairs with the one in
+ * wait_on: either the waiter is seen here or it sees the ring change */
+void wake(int* word, int* waiters, int count) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiters, __ATOMIC_RELAXED) > 0) {
+		__atomic_fetch_add(word, 1, __ATOMIC_SEQ_CST);
+		syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+	}
+	return;
+}
+
+/* Sleeps until the futex word changes.  The ring is checked again after
+ * registering as a waiter so a wake-up between the caller's failed
+ * attempt and the sleep cannot be lost */
+void wait_on(int* word, int* waiters, queue_t* queue, int for_space) {
+	int value;
+	uint64_t head;
+	uint64_t tail;
+	/* futex(2) through syscall() is not a cancellation point */
+	pthread_testcancel();
+	value = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add(waiters, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	tail = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_SEQ_CST);
+	head = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_SEQ_CST);
+	if ((for_space && tail - head > queue->mask) || (!for_space && tail == head)) {
+		syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+	}
+	__atomic_fetch_sub(waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_testcancel();
+	return;
+}
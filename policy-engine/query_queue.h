@@ -1,26 +1,43 @@
 #ifndef _QUERY_QUEUE_H
 #define _QUERY_QUEUE_H
 
-#include <semaphore.h>
-#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
 #include "query.h"
 
-typedef struct queue_node_t {
-	struct queue_node_t* next;
-	struct queue_node_t* prev;
+#define CACHE_LINE_SIZE	64
+
+enum {
+	QUEUE_OVERFLOW_BLOCK,
+	QUEUE_OVERFLOW_DROP,
+};
+
+typedef struct queue_cell_t {
+	uint64_t sequence;
 	query_t* query;
-} queue_node_t;
+} queue_cell_t;
 
+/* Bounded multi-producer/multi-consumer ring.  The producer and consumer
+ * cursors live on separate cache lines so the two sides do not contend */
 typedef struct queue_t {
-	queue_node_t* head;
-	queue_node_t* tail;
-	sem_t* fill_sem;
-	pthread_mutex_t mutex;
+	queue_cell_t* cells;
+	uint64_t mask;
+	int overflow;
+	uint64_t enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint64_t dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+	/* futex words, only bumped while their side has sleepers, each on its
+	 * own line with its waiter count */
+	int not_empty __attribute__((aligned(CACHE_LINE_SIZE)));
+	int empty_waiters;
+	int not_full __attribute__((aligned(CACHE_LINE_SIZE)));
+	int full_waiters;
 } queue_t;
 
-queue_t* make_queue(const char*);
-void free_queue(queue_t* queue, const char*);
+queue_t* make_queue(const char* name, size_t capacity, int overflow);
+void free_queue(queue_t* queue, void (*release)(query_t* query, int owner), int owner);
 int enqueue(queue_t* queue, query_t* query);
+int enqueue_nowait(queue_t* queue, query_t* query);
 query_t* dequeue(queue_t* queue);
+void queue_wake_all(queue_t* queue);
 
 #endif
@@ -0,0 +1,268 @@
+/*
+ * Shared, hot-reloadable root store for CA validation.
+ *
+ * A store is never modified once it is built.  Reloading builds a new one
+ * from the bundle in the background and swaps it in, so validation never
+ * waits on a rebuild.  There are two slots: readers register on the
+ * current one, and a reload installs the new store in the other slot
+ * once the readers still using the store that was previously there have
+ * left, then makes it current.  Readers of the slot that was current
+ * finish with it undisturbed and it is freed by the next reload.
+ *
+ * root_store_watch reloads the store whenever the bundle file changes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <libgen.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "tb_logging.h"
+#include "ca_validation.h"
+#include "root_store.h"
+
+#define WATCH_EVENTS	(IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+
+/* A watched directory and the name of the bundle in it */
+typedef struct bundle_watch_t {
+	int wd;
+	const char* name;
+} bundle_watch_t;
+
+static int add_watch(int fd, const char* path, bundle_watch_t* watch);
+static int watch_target(root_store_t* roots, bundle_watch_t* watches, int count, char* resolved);
+static int names_bundle(bundle_watch_t* watches, int count, struct inotify_event* event);
+
+/**
+ * Loads the bundle at path into a new shared root store.  If it cannot be
+ * read the store starts out empty, so a later reload can still fix it.
+ * @returns the root store or NULL on failure
+ */
+root_store_t* root_store_create(const char* path) {
+	root_store_t* roots;
+	roots = (root_store_t*)calloc(1, sizeof(root_store_t));
+	if (roots == NULL) {
+		tblog(LOG_ERROR, "Failed to allocate space for root store");
+		return NULL;
+	}
+	roots->path = strdup(path);
+	if (roots->path == NULL) {
+		tblog(LOG_ERROR, "Failed to allocate space for root store path");
+		free(roots);
+		return NULL;
+	}
+	if (pthread_mutex_init(&roots->reload_mutex, NULL) != 0) {
+		tblog(LOG_ERROR, "Failed to create mutex for root store");
+		free(roots->path);
+		free(roots);
+		return NULL;
+	}
+	roots->watch_fd = -1;
+	roots->stores[0] = load_root_store(path);
+	return roots;
+}
+
+/**
+ * Frees the root store.  No reader or watcher may be left.
+ */
+void root_store_free(root_store_t* roots) {
+	if (roots == NULL) {
+		return;
+	}
+	if (roots->watch_fd >= 0) {
+		close(roots->watch_fd);
+	}
+	X509_STORE_free(roots->stores[0]);
+	X509_STORE_free(roots->stores[1]);
+	pthread_mutex_destroy(&roots->reload_mutex);
+	free(roots->path);
+	free(roots);
+	return;
+}
+
+/**
+ * Gets the current store for one verification.  Never blocks.
+ * @param slot receives the slot to hand back to root_store_release
+ * @returns the store, or NULL if no bundle could be loaded yet
+ */
+X509_STORE* root_store_acquire(root_store_t* roots, int* slot) {
+	int current;
+	while (1) {
+		current = __atomic_load_n(&roots->current, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&roots->readers[current], 1, __ATOMIC_SEQ_CST);
+		/* If a reload moved on meanwhile the slot may be recycled */
+		if (__atomic_load_n(&roots->current, __ATOMIC_SEQ_CST) == current) {
+			break;
+		}
+		__atomic_sub_fetch(&roots->readers[current], 1, __ATOMIC_SEQ_CST);
+	}
+	*slot = current;
+	return __atomic_load_n(&roots->stores[current], __ATOMIC_SEQ_CST);
+}
+
+void root_store_release(root_store_t* roots, int slot) {
+	__atomic_sub_fetch(&roots->readers[slot], 1, __ATOMIC_SEQ_CST);
+	return;
+}
+
+/**
+ * Rebuilds the store from the bundle and swaps it in.  On failure the
+ * store in use is kept.
+ * @returns 0 on success, 1 on failure
+ */
+int root_store_reload(root_store_t* roots) {
+	X509_STORE* store;
+	X509_STORE* old;
+	int next;
+	store = load_root_store(roots->path);
+	if (store == NULL) {
+		tblog(LOG_ERROR, "Keeping the previous root store");
+		return 1;
+	}
+	pthread_mutex_lock(&roots->reload_mutex);
+	next = !roots->current;
+	/* Whoever still uses the store from two reloads ago is finishing a
+	 * single verification */
+	while (__atomic_load_n(&roots->readers[next], __ATOMIC_SEQ_CST) > 0) {
+		sched_yield();
+	}
+	old = roots->stores[next];
+	__atomic_store_n(&roots->stores[next], store, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&roots->current, next, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&roots->reload_mutex);
+	X509_STORE_free(old);
+	tblog(LOG_INFO, "Reloaded root store from %s", roots->path);
+	if (roots->reloaded != NULL) {
+		roots->reloaded();
+	}
+	return 0;
+}
+
+/**
+ * Thread body that reloads the store whenever its bundle is rewritten,
+ * replaced or, through a symlink, retargeted.  Runs until cancelled or
+ * until the watch can no longer be read.
+ * @param arg the root_store_t
+ */
+void* root_store_watch(void* arg) {
+	root_store_t* roots;
+	struct pollfd settle;
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char resolved[PATH_MAX];
+	bundle_watch_t watches[2];
+	struct inotify_event* event;
+	ssize_t len;
+	ssize_t offset;
+	int count;
+	int changed;
+	roots = (root_store_t*)arg;
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+	roots->watch_fd = inotify_init();
+	if (roots->watch_fd < 0) {
+		tblog(LOG_ERROR, "Could not watch the root store, changes need a restart");
+		return NULL;
+	}
+	/* Bundles are usually replaced rather than rewritten, so watch the
+	 * directories holding the link and the file it points to */
+	if (add_watch(roots->watch_fd, roots->path, &watches[0]) != 0) {
+		return NULL;
+	}
+	count = 1;
+	resolved[0] = '\0';
+	count = watch_target(roots, watches, count, resolved);
+
+	while (1) {
+		len = read(roots->watch_fd, events, sizeof(events));
+		if (len < 0 && errno == EINTR) {
+			continue;
+		}
+		if (len <= 0) {
+			tblog(LOG_ERROR, "Stopped watching the root store, changes need a restart: %s", len < 0 ? strerror(errno) : "end of file");
+			return NULL;
+		}
+		changed = 0;
+		for (offset = 0; offset < len; offset += sizeof(struct inotify_event) + event->len) {
+			event = (struct inotify_event*)(events + offset);
+			changed |= names_bundle(watches, count, event);
+		}
+		if (!changed) {
+			continue;
+		}
+		/* Package managers write bundles in several steps, wait until
+		 * they are done before loading it */
+		settle.fd = roots->watch_fd;
+		settle.events = POLLIN;
+		while (poll(&settle, 1, ROOT_STORE_SETTLE * 1000) > 0) {
+			if (read(roots->watch_fd, events, sizeof(events)) <= 0) {
+				break;
+			}
+		}
+		root_store_reload(roots);
+		/* The link may now point somewhere else */
+		count = watch_target(roots, watches, count, resolved);
+	}
+	return NULL;
+}
+
+/* Moves the second watch to wherever the bundle path now resolves to.
+ * resolved holds the target being watched, empty if none, and is
+ * updated.  Returns the number of watches in use */
+int watch_target(root_store_t* roots, bundle_watch_t* watches, int count, char* resolved) {
+	char target[PATH_MAX];
+	if (realpath(roots->path, target) == NULL || strcmp(target, roots->path) == 0) {
+		target[0] = '\0';
+	}
+	if (strcmp(target, resolved) == 0) {
+		return count;
+	}
+	/* A target in the link's own directory shares its watch */
+	if (count == 2 && watches[1].wd != watches[0].wd) {
+		inotify_rm_watch(roots->watch_fd, watches[1].wd);
+	}
+	count = 1;
+	strcpy(resolved, target);
+	if (resolved[0] != '\0' && add_watch(roots->watch_fd, resolved, &watches[1]) == 0) {
+		count = 2;
+	}
+	return count;
+}
+
+/* Watches the directory containing path for changes to its last
+ * component.  path must outlive the watch */
+int add_watch(int fd, const char* path, bundle_watch_t* watch) {
+	char* copy;
+	const char* name;
+	copy = strdup(path);
+	if (copy == NULL) {
+		return 1;
+	}
+	watch->wd = inotify_add_watch(fd, dirname(copy), WATCH_EVENTS);
+	if (watch->wd < 0) {
+		tblog(LOG_ERROR, "Could not watch %s, root store changes need a restart", copy);
+		free(copy);
+		return 1;
+	}
+	free(copy);
+	name = strrchr(path, '/');
+	watch->name = name != NULL ? name + 1 : path;
+	return 0;
+}
+
+/* Whether an event concerns the bundle or the file it links to */
+int names_bundle(bundle_watch_t* watches, int count, struct inotify_event* event) {
+	int i;
+	if (event->len == 0) {
+		return 0;
+	}
+	for (i = 0; i < count; i++) {
+		if (event->wd == watches[i].wd && strcmp(event->name, watches[i].name) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef _ROOT_STORE_H
+#define _ROOT_STORE_H
+
+#include <pthread.h>
+#include <openssl/x509.h>
+
+/* Seconds a changed bundle has to stay quiet before it is reloaded */
+#define ROOT_STORE_SETTLE	1
+
+/* The CA system's trusted roots, shared by every CA validation thread and
+ * swapped for a rebuilt store when the bundle changes.  Readers register
+ * on the slot they use, see root_store_acquire */
+typedef struct root_store_t {
+	pthread_mutex_t reload_mutex; /* serializes reloads */
+	X509_STORE* stores[2];
+	int readers[2];
+	int current; /* slot new readers use */
+	char* path;
+	int watch_fd;
+	/* Called after a new store has been swapped in (optional) */
+	void (*reloaded)(void);
+} root_store_t;
+
+root_store_t* root_store_create(const char* path);
+void root_store_free(root_store_t* roots);
+X509_STORE* root_store_acquire(root_store_t* roots, int* slot);
+void root_store_release(root_store_t* roots, int slot);
+int root_store_reload(root_store_t* roots);
+void* root_store_watch(void* arg);
+
+#endif
@@ -0,0 +1,54 @@
+#include <stdlib.h>
+#include "tb_logging.h"
+#include "rx_buffer.h"
+
+/**
+ * Allocates a buffer with room for a datagram of size bytes, holding the
+ * caller's reference
+ * @returns the buffer or NULL on failure
+ */
+rx_buffer_t* rx_buffer_alloc(size_t size) {
+	rx_buffer_t* buffer;
+	buffer = (rx_buffer_t*)malloc(sizeof(rx_buffer_t) + size);
+	if (buffer == NULL) {
+		tblog(LOG_WARNING, "Could not allocate receive buffer");
+		return NULL;
+	}
+	buffer->refcount = 1;
+	buffer->len = size;
+	return buffer;
+}
+
+/**
+ * Gives back the room a received datagram did not use.  Only valid while
+ * the caller holds the sole reference, as the buffer may move.
+ * @returns the buffer, possibly moved
+ */
+rx_buffer_t* rx_buffer_shrink(rx_buffer_t* buffer, size_t len) {
+	rx_buffer_t* shrunk;
+	/* Shrinking a heap chunk splits it in place, no copy is made */
+	shrunk = (rx_buffer_t*)realloc(buffer, sizeof(rx_buffer_t) + len);
+	if (shrunk == NULL) {
+		return buffer;
+	}
+	shrunk->len = len;
+	return shrunk;
+}
+
+void rx_buffer_get(rx_buffer_t* buffer) {
+	__atomic_add_fetch(&buffer->refcount, 1, __ATOMIC_RELAXED);
+	return;
+}
+
+/**
+ * Drops a reference, freeing the buffer with the last one
+ */
+void rx_buffer_put(rx_buffer_t* buffer) {
+	if (buffer == NULL) {
+		return;
+	}
+	if (__atomic_sub_fetch(&buffer->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(buffer);
+	}
+	return;
+}
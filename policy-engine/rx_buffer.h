@@ -0,0 +1,20 @@
+#ifndef _RX_BUFFER_H
+#define _RX_BUFFER_H
+
+#include <stddef.h>
+
+/* A datagram received from the kernel.  The messages in it and the
+ * queries made from them point into data and hold a reference each, so
+ * certificate chains and hellos are never copied */
+typedef struct rx_buffer_t {
+	int refcount;
+	size_t len;
+	unsigned char data[] __attribute__((aligned(8)));
+} rx_buffer_t;
+
+rx_buffer_t* rx_buffer_alloc(size_t size);
+rx_buffer_t* rx_buffer_shrink(rx_buffer_t* buffer, size_t len);
+void rx_buffer_get(rx_buffer_t* buffer);
+void rx_buffer_put(rx_buffer_t* buffer);
+
+#endif
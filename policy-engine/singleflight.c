@@ -0,0 +1,164 @@
+/*
+ * Coalescing of identical in-flight queries.
+ *
+ * When many connections to the same host present the same chain at once
+ * only the first query (the leader) is evaluated.  The others attach a
+ * waiter to the leader and receive its verdict when it is sent.  Leaders
+ * are only joined until they are finalized, so every waiter is guaranteed
+ * to be picked up by singleflight_leave.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "tb_logging.h"
+#include "singleflight.h"
+
+static query_t** find_slot(singleflight_t* flights, const unsigned char* key);
+
+/**
+ * Create a new empty table
+ * @param buckets number of hash buckets, rounded up to a power of two
+ * @returns table pointer or NULL on failure
+ */
+singleflight_t* singleflight_create(size_t buckets) {
+	singleflight_t* flights;
+	size_t size;
+	size = 2;
+	while (size < buckets) {
+		size <<= 1;
+	}
+	flights = (singleflight_t*)malloc(sizeof(singleflight_t));
+	if (flights == NULL) {
+		tblog(LOG_ERROR, "Failed to allocate space for singleflight table");
+		return NULL;
+	}
+	flights->buckets = (query_t**)calloc(size, sizeof(query_t*));
+	if (flights->buckets == NULL) {
+		tblog(LOG_ERROR, "Failed to allocate %zu buckets for singleflight table", size);
+		free(flights);
+		return NULL;
+	}
+	if (pthread_mutex_init(&flights->mutex, NULL) != 0) {
+		tblog(LOG_ERROR, "Failed to create mutex for singleflight table");
+		free(flights->buckets);
+		free(flights);
+		return NULL;
+	}
+	flights->mask = size - 1;
+	return flights;
+}
+
+/**
+ * Frees the table.  Queries still in it are not freed.
+ */
+void singleflight_free(singleflight_t* flights) {
+	if (flights == NULL) {
+		return;
+	}
+	pthread_mutex_destroy(&flights->mutex);
+	free(flights->buckets);
+	free(flights);
+	return;
+}
+
+/**
+ * Attaches a connection to the in-flight query with the same key, if any
+ * @returns 1 if the connection will receive that query's verdict, 0 if
+ * it has to be evaluated itself
+ */
+int singleflight_join(singleflight_t* flights, const unsigned char* key, uint32_t spid, uint64_t stptr) {
+	query_waiter_t* waiter;
+	query_t* leader;
+	int joined;
+	joined = 0;
+	pthread_mutex_lock(&flights->mutex);
+	leader = *find_slot(flights, key);
+	if (leader == NULL) {
+		pthread_mutex_unlock(&flights->mutex);
+		return 0;
+	}
+	waiter = (query_waiter_t*)malloc(sizeof(query_waiter_t));
+	if (waiter == NULL) {
+		pthread_mutex_unlock(&flights->mutex);
+		tblog(LOG_WARNING, "Could not allocate waiter, evaluating query separately");
+		return 0;
+	}
+	waiter->spid = spid;
+	waiter->state_pointer = stptr;
+	/* The leader stays alive while it is in the table */
+	pthread_mutex_lock(&leader->mutex);
+	if (!leader->finalized) {
+		waiter->next = leader->waiters;
+		leader->waiters = waiter;
+		joined = 1;
+	}
+	pthread_mutex_unlock(&leader->mutex);
+	pthread_mutex_unlock(&flights->mutex);
+	if (!joined) {
+		free(waiter);
+	}
+	return joined;
+}
+
+/**
+ * Makes a query the one identical queries wait on.  It replaces any
+ * finalized leader with the same key that has not left yet.
+ */
+void singleflight_lead(singleflight_t* flights, query_t* query) {
+	query_t** slot;
+	pthread_mutex_lock(&flights->mutex);
+	slot = find_slot(flights, query->key);
+	if (*slot != NULL) {
+		query->flight_next = (*slot)->flight_next;
+		(*slot)->flight_next = NULL;
+	}
+	else {
+		query->flight_next = NULL;
+	}
+	*slot = query;
+	pthread_mutex_unlock(&flights->mutex);
+	return;
+}
+
+/**
+ * Removes a finalized query from the table.  The caller must have set
+ * query->finalized and is responsible for answering and freeing the
+ * returned waiters.
+ * @returns the list of connections waiting on the query's verdict
+ */
+query_waiter_t* singleflight_leave(singleflight_t* flights, query_t* query) {
+	query_waiter_t* waiters;
+	query_t** slot;
+	size_t hash;
+	pthread_mutex_lock(&flights->mutex);
+	memcpy(&hash, query->key, sizeof(hash));
+	slot = &flights->buckets[hash & flights->mask];
+	while (*slot != NULL && *slot != query) {
+		slot = &(*slot)->flight_next;
+	}
+	if (*slot == query) {
+		*slot = query->flight_next;
+		query->flight_next = NULL;
+	}
+	pthread_mutex_unlock(&flights->mutex);
+
+	/* No one can join a finalized query, so the list is complete */
+	pthread_mutex_lock(&query->mutex);
+	waiters = query->waiters;
+	query->waiters = NULL;
+	pthread_mutex_unlock(&query->mutex);
+	return waiters;
+}
+
+/* Returns the link pointing at the query with key, or at the NULL ending
+ * its bucket.  Caller must hold the table mutex */
+query_t** find_slot(singleflight_t* flights, const unsigned char* key) {
+	query_t** slot;
+	size_t hash;
+	memcpy(&hash, key, sizeof(hash));
+	slot = &flights->buckets[hash & flights->mask];
+	while (*slot != NULL && memcmp((*slot)->key, key, VERDICT_CACHE_KEY_LEN) != 0) {
+		slot = &(*slot)->flight_next;
+	}
+	return slot;
+}
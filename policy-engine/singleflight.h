@@ -0,0 +1,25 @@
+#ifndef _SINGLEFLIGHT_H
+#define _SINGLEFLIGHT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "query.h"
+
+/* Table of queries currently being evaluated, keyed by query_t.key, so
+ * that identical queries arriving meanwhile can wait for the same verdict
+ * instead of being evaluated again.  Queries are chained through
+ * query_t.flight_next */
+typedef struct singleflight_t {
+	pthread_mutex_t mutex;
+	size_t mask;
+	query_t** buckets;
+} singleflight_t;
+
+singleflight_t* singleflight_create(size_t buckets);
+void singleflight_free(singleflight_t* flights);
+int singleflight_join(singleflight_t* flights, const unsigned char* key, uint32_t spid, uint64_t stptr);
+void singleflight_lead(singleflight_t* flights, query_t* query);
+query_waiter_t* singleflight_leave(singleflight_t* flights, query_t* query);
+
+#endif
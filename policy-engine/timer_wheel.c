@@ -0,0 +1,304 @@
+/*
+ * Hierarchical timer wheel used to enforce plugin deadlines.
+ *
+ * This follows the classic cascading wheel design of the Linux kernel:
+ * timers are hashed into one of TIMER_WHEEL_LEVELS levels of
+ * TIMER_WHEEL_SIZE slots depending on how far away they expire, and
+ * the slots of the higher levels are cascaded down as time advances.
+ * Adding and cancelling a timer are O(1) and a single thread can track
+ * any number of in-flight deadlines.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include "tb_logging.h"
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_MAX_TICKS	((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+static void list_init(timer_entry_t* head);
+static void list_append(timer_entry_t* head, timer_entry_t* entry);
+static void list_unlink(timer_entry_t* entry);
+static void list_splice(timer_entry_t* from, timer_entry_t* to);
+static void internal_add_timer(timer_wheel_t* wheel, timer_entry_t* timer);
+static int cascade(timer_wheel_t* wheel, int level, int index);
+static void run_tick(timer_wheel_t* wheel);
+static uint64_t now_ticks(timer_wheel_t* wheel);
+
+/**
+ * Create a new timer wheel.  The wheel does not fire anything until
+ * timer_wheel_run is started on a thread of its own.
+ * @param tick_ms granularity of the wheel in milliseconds
+ * @returns wheel pointer or NULL on failure
+ */
+timer_wheel_t* timer_wheel_create(unsigned int tick_ms) {
+	timer_wheel_t* wheel;
+	int i;
+	int j;
+	wheel = (timer_wheel_t*)malloc(sizeof(timer_wheel_t));
+	if (wheel == NULL) {
+		tblog(LOG_ERROR, "Failed to allocate space for timer wheel");
+		return NULL;
+	}
+	if (pthread_mutex_init(&wheel->mutex, NULL) != 0) {
+		tblog(LOG_ERROR, "Failed to create mutex for timer wheel");
+		free(wheel);
+		return NULL;
+	}
+	if (pthread_cond_init(&wheel->fired, NULL) != 0) {
+		tblog(LOG_ERROR, "Failed to create condvar for timer wheel");
+		pthread_mutex_destroy(&wheel->mutex);
+		free(wheel);
+		return NULL;
+	}
+	for (i = 0; i < TIMER_WHEEL_LEVELS; i++) {
+		for (j = 0; j < TIMER_WHEEL_SIZE; j++) {
+			list_init(&wheel->levels[i][j]);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &wheel->start);
+	wheel->tick_ms = tick_ms > 0 ? tick_ms : 1;
+	wheel->current_tick = 0;
+	wheel->running = NULL;
+	wheel->thread = pthread_self();
+	return wheel;
+}
+
+/**
+ * Frees the wheel.  Pending timers are dropped without firing, their
+ * owners are responsible for the memory behind them.
+ */
+void timer_wheel_free(timer_wheel_t* wheel) {
+	if (wheel == NULL) {
+		return;
+	}
+	if (pthread_cond_destroy(&wheel->fired) != 0) {
+		tblog(LOG_ERROR, "Failed to destroy timer wheel condvar");
+	}
+	if (pthread_mutex_destroy(&wheel->mutex) != 0) {
+		tblog(LOG_ERROR, "Failed to destroy timer wheel mutex");
+	}
+	free(wheel);
+	return;
+}
+
+/**
+ * Thread body that advances the wheel once per tick and runs the
+ * callbacks of expired timers.  Callbacks run without the wheel lock
+ * held so they may add or cancel timers themselves.
+ */
+void* timer_wheel_run(void* arg) {
+	timer_wheel_t* wheel;
+	struct timespec next;
+	uint64_t target;
+	wheel = (timer_wheel_t*)arg;
+
+	pthread_mutex_lock(&wheel->mutex);
+	wheel->thread = pthread_self();
+	pthread_mutex_unlock(&wheel->mutex);
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	while (1) {
+		target = now_ticks(wheel);
+		pthread_mutex_lock(&wheel->mutex);
+		while (wheel->current_tick <= target) {
+			run_tick(wheel);
+		}
+		pthread_mutex_unlock(&wheel->mutex);
+
+		/* Sleep until the start of the next tick */
+		next = wheel->start;
+		next.tv_sec += ((target + 1) * wheel->tick_ms) / 1000;
+		next.tv_nsec += (((target + 1) * wheel->tick_ms) % 1000) * 1000000L;
+		if (next.tv_nsec >= 1000000000L) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+	}
+	return NULL;
+}
+
+/**
+ * Prepares a timer for use.  Must be called once before timer_add.
+ */
+void timer_init(timer_entry_t* timer, void (*func)(void*), void* arg) {
+	timer->next = NULL;
+	timer->prev = NULL;
+	timer->expires = 0;
+	timer->state = TIMER_IDLE;
+	timer->func = func;
+	timer->arg = arg;
+	return;
+}
+
+/**
+ * Arms a timer to fire timeout_ms from now.  A timer that is already
+ * pending is moved to the new deadline.
+ * @returns 1 if the timer was pending before, 0 otherwise
+ */
+int timer_add(timer_wheel_t* wheel, timer_entry_t* timer, unsigned int timeout_ms) {
+	int was_pending;
+	uint64_t ticks;
+	ticks = (timeout_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+	pthread_mutex_lock(&wheel->mutex);
+	was_pending = 0;
+	if (timer->state == TIMER_PENDING) {
+		list_unlink(timer);
+		was_pending = 1;
+	}
+	/* Expiry is measured from real time rather than from the last
+	 * processed tick so a lagging wheel does not shorten deadlines */
+	timer->expires = now_ticks(wheel) + (ticks > 0 ? ticks : 1);
+	timer->state = TIMER_PENDING;
+	internal_add_timer(wheel, timer);
+	pthread_mutex_unlock(&wheel->mutex);
+	return was_pending;
+}
+
+/**
+ * Cancels a timer.  If its callback is currently running on the wheel
+ * thread this waits for it to return, so once timer_cancel returns the
+ * callback is guaranteed not to touch the timer's owner, even if it
+ * re-armed the timer.  Calling this from within the callback itself does
+ * not wait.
+ * @returns 1 if a pending timer was cancelled, 0 otherwise
+ */
+int timer_cancel(timer_wheel_t* wheel, timer_entry_t* timer) {
+	pthread_mutex_lock(&wheel->mutex);
+	while (1) {
+		if (timer->state == TIMER_PENDING) {
+			list_unlink(timer);
+			timer->state = TIMER_IDLE;
+			pthread_mutex_unlock(&wheel->mutex);
+			return 1;
+		}
+		if (pthread_equal(pthread_self(), wheel->thread) || wheel->running != timer) {
+			break;
+		}
+		pthread_cond_wait(&wheel->fired, &wheel->mutex);
+	}
+	pthread_mutex_unlock(&wheel->mutex);
+	return 0;
+}
+
+/* Caller must hold the wheel mutex */
+void internal_add_timer(timer_wheel_t* wheel, timer_entry_t* timer) {
+	uint64_t expires;
+	int64_t delta;
+	int level;
+	int index;
+
+	expires = timer->expires;
+	delta = (int64_t)(expires - wheel->current_tick);
+	if (delta < 0) {
+		/* Already expired, fire on the next tick */
+		expires = wheel->current_tick;
+		delta = 0;
+	}
+	else if (delta > TIMER_WHEEL_MAX_TICKS) {
+		expires = wheel->current_tick + TIMER_WHEEL_MAX_TICKS;
+		delta = TIMER_WHEEL_MAX_TICKS;
+		timer->expires = expires;
+	}
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+		if (delta < (1LL << (TIMER_WHEEL_BITS * (level + 1)))) {
+			break;
+		}
+	}
+	index = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+	list_append(&wheel->levels[level][index], timer);
+	return;
+}
+
+/* Re-hashes every timer of one slot into lower levels.
+ * Caller must hold the wheel mutex */
+int cascade(timer_wheel_t* wheel, int level, int index) {
+	timer_entry_t work;
+	timer_entry_t* timer;
+	list_init(&work);
+	list_splice(&wheel->levels[level][index], &work);
+	while (work.next != &work) {
+		timer = work.next;
+		list_unlink(timer);
+		internal_add_timer(wheel, timer);
+	}
+	return index;
+}
+
+/* Processes a single tick.  Caller must hold the wheel mutex, which is
+ * dropped while each callback runs */
+void run_tick(timer_wheel_t* wheel) {
+	timer_entry_t work;
+	timer_entry_t* timer;
+	int index;
+	int level;
+
+	index = wheel->current_tick & TIMER_WHEEL_MASK;
+	/* Wrapped around the lowest level, pull the next batch down */
+	for (level = 1; level < TIMER_WHEEL_LEVELS && index == 0; level++) {
+		index = cascade(wheel, level, (wheel->current_tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+	}
+	index = wheel->current_tick & TIMER_WHEEL_MASK;
+	wheel->current_tick++;
+
+	list_init(&work);
+	list_splice(&wheel->levels[0][index], &work);
+	while (work.next != &work) {
+		timer = work.next;
+		list_unlink(timer);
+		/* The callback may free the timer's owner, so the timer is
+		 * not touched once it has run.  It may re-arm it meanwhile */
+		timer->state = TIMER_IDLE;
+		wheel->running = timer;
+		pthread_mutex_unlock(&wheel->mutex);
+		timer->func(timer->arg);
+		pthread_mutex_lock(&wheel->mutex);
+		wheel->running = NULL;
+		pthread_cond_broadcast(&wheel->fired);
+	}
+	return;
+}
+
+uint64_t now_ticks(timer_wheel_t* wheel) {
+	struct timespec now;
+	uint64_t elapsed_ms;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed_ms = (now.tv_sec - wheel->start.tv_sec) * 1000ULL;
+	elapsed_ms += (now.tv_nsec - wheel->start.tv_nsec) / 1000000L;
+	return elapsed_ms / wheel->tick_ms;
+}
+
+void list_init(timer_entry_t* head) {
+	head->next = head;
+	head->prev = head;
+	return;
+}
+
+void list_append(timer_entry_t* head, timer_entry_t* entry) {
+	entry->prev = head->prev;
+	entry->next = head;
+	head->prev->next = entry;
+	head->prev = entry;
+	return;
+}
+
+void list_unlink(timer_entry_t* entry) {
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	entry->next = NULL;
+	entry->prev = NULL;
+	return;
+}
+
+/* Moves every entry of from to the (empty) list to */
+void list_splice(timer_entry_t* from, timer_entry_t* to) {
+	if (from->next == from) {
+		return;
+	}
+	to->next = from->next;
+	to->prev = from->prev;
+	to->next->prev = to;
+	to->prev->next = to;
+	list_init(from);
+	return;
+}
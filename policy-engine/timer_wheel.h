@@ -0,0 +1,45 @@
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SIZE	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK	(TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS	4
+
+enum {
+	TIMER_IDLE,
+	TIMER_PENDING,
+};
+
+typedef struct timer_entry_t {
+	struct timer_entry_t* next;
+	struct timer_entry_t* prev;
+	uint64_t expires; /* in ticks */
+	int state;
+	void (*func)(void* arg);
+	void* arg;
+} timer_entry_t;
+
+typedef struct timer_wheel_t {
+	pthread_mutex_t mutex;
+	pthread_cond_t fired;
+	pthread_t thread;
+	struct timespec start;
+	unsigned int tick_ms;
+	uint64_t current_tick; /* next tick to be processed */
+	timer_entry_t* running; /* entry whose callback is executing */
+	timer_entry_t levels[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+} timer_wheel_t;
+
+timer_wheel_t* timer_wheel_create(unsigned int tick_ms);
+void timer_wheel_free(timer_wheel_t* wheel);
+void* timer_wheel_run(void* arg);
+void timer_init(timer_entry_t* timer, void (*func)(void*), void* arg);
+int timer_add(timer_wheel_t* wheel, timer_entry_t* timer, unsigned int timeout_ms);
+int timer_cancel(timer_wheel_t* wheel, timer_entry_t* timer);
+
+#endif
@@ -0,0 +1,443 @@
+/*
+ * Set of (address, port) pairs known to speak TLS.
+ *
+ * Every query records its server as a pin and SHOULDTLS messages ask
+ * whether a server was pinned, while the kernel holds the connection.
+ * Both arrive on the thread receiving from the kernel, so neither may
+ * wait on the disk.  All pins are loaded into memory at startup and new
+ * ones are queued for a writer thread, which inserts them into the SQLite
+ * database in batches, one transaction per batch.
+ *
+ * Most servers asked about were never pinned.  A bloom filter in front
+ * of the set answers those without taking the lock.  It is rebuilt twice
+ * as large whenever the set outgrows it; filters replaced while a lookup
+ * may still read them are only freed on close.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include "tb_logging.h"
+#include "tls_pins.h"
+
+#define INITIAL_BUCKETS	1024
+/* Filter bits per pin and bits set per pin, for about 0.3% false positives */
+#define BLOOM_BITS_PER_PIN	16
+#define BLOOM_HASHES		4
+#define BLOOM_MIN_PINS		4096
+
+typedef struct tls_pin_t {
+	struct tls_pin_t* hash_next;
+	struct tls_pin_t* pending_next;
+	uint16_t port;
+	char host[];
+} tls_pin_t;
+
+typedef struct pin_bloom_t {
+	struct pin_bloom_t* retired_next;
+	size_t capacity; /* pins it was sized for */
+	size_t mask; /* bits - 1 */
+	uint64_t words[];
+} pin_bloom_t;
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t wake; /* signals the writer */
+	tls_pin_t** buckets;
+	size_t mask;
+	size_t count;
+	tls_pin_t* pending; /* pins not written yet */
+	size_t pending_count;
+	int running;
+	pin_bloom_t* bloom; /* read without the lock */
+	pin_bloom_t* retired;
+	pthread_t writer;
+	sqlite3* write_db; /* used by the writer once started */
+	sqlite3_stmt* insert;
+} pins = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, NULL, 0, 0 };
+
+static void* writer_thread(void* arg);
+static void write_batch(tls_pin_t* batch);
+static tls_pin_t** find_slot(const char* host, uint16_t port);
+static tls_pin_t* insert_pin(const char* host, uint16_t port);
+static void grow_buckets(void);
+static int load_pins(void);
+static pin_bloom_t* bloom_create(size_t capacity);
+static void bloom_add(pin_bloom_t* bloom, size_t hash);
+static int bloom_test(pin_bloom_t* bloom, size_t hash);
+static size_t hash_pin(const char* host, uint16_t port);
+
+/**
+ * Opens the pin database, loads its pins and starts the writer
+ * @param path location of the SQLite database, created if missing
+ * @returns 0 on success, 1 on failure
+ */
+int tls_pins_init(const char* path) {
+	if (sqlite3_open(path, &pins.write_db) != SQLITE_OK) {
+		tblog(LOG_ERROR, "Failed to open sqlite database for tls pinning");
+		return 1;
+	}
+	/* Commits append to the log rather than rewriting the database */
+	if (sqlite3_exec(pins.write_db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL) != SQLITE_OK) {
+		tblog(LOG_WARNING, "Could not put tls pinning database in WAL mode, %s", sqlite3_errmsg(pins.write_db));
+	}
+	sqlite3_exec(pins.write_db, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL);
+	if (sqlite3_exec(pins.write_db, "CREATE TABLE IF NOT EXISTS Pins (Hostname TEXT, Port INT, PRIMARY KEY (Hostname, Port))", NULL, NULL, NULL) != SQLITE_OK) {
+		tblog(LOG_ERROR, "Pin table creation failed %s", sqlite3_errmsg(pins.write_db));
+		return 1;
+	}
+	if (sqlite3_prepare_v2(pins.write_db, "INSERT OR IGNORE INTO Pins VALUES (?1, ?2)", -1, &pins.insert, NULL) != SQLITE_OK) {
+		tblog(LOG_ERROR, "Failed to prepare pin insert, %s", sqlite3_errmsg(pins.write_db));
+		return 1;
+	}
+	pins.buckets = (tls_pin_t**)calloc(INITIAL_BUCKETS, sizeof(tls_pin_t*));
+	if (pins.buckets == NULL) {
+		tblog(LOG_ERROR, "Failed to allocate space for tls pins");
+		return 1;
+	}
+	pins.mask = INITIAL_BUCKETS - 1;
+	if (load_pins() != 0) {
+		return 1;
+	}
+	pins.running = 1;
+	if (pthread_create(&pins.writer, NULL, writer_thread, NULL) != 0) {
+		tblog(LOG_ERROR, "Failed to start tls pin writer");
+		pins.running = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Writes the pins still queued, stops the writer and frees the set
+ */
+void tls_pins_close(void) {
+	tls_pin_t* pin;
+	tls_pin_t* next;
+	pin_bloom_t* bloom;
+	size_t i;
+	pthread_mutex_lock(&pins.mutex);
+	if (pins.running) {
+		pins.running = 0;
+		pthread_cond_signal(&pins.wake);
+		pthread_mutex_unlock(&pins.mutex);
+		pthread_join(pins.writer, NULL);
+	}
+	else {
+		pthread_mutex_unlock(&pins.mutex);
+	}
+	sqlite3_finalize(pins.insert);
+	sqlite3_close(pins.write_db);
+	free(pins.bloom);
+	pins.bloom = NULL;
+	while (pins.retired != NULL) {
+		bloom = pins.retired;
+		pins.retired = bloom->retired_next;
+		free(bloom);
+	}
+	if (pins.buckets != NULL) {
+		for (i = 0; i <= pins.mask; i++) {
+			for (pin = pins.buckets[i]; pin != NULL; pin = next) {
+				next = pin->hash_next;
+				free(pin);
+			}
+		}
+		free(pins.buckets);
+		pins.buckets = NULL;
+	}
+	return;
+}
+
+/**
+ * Records that host speaks TLS on port.  Never waits on the database.
+ */
+void tls_pins_add(const char* host, uint16_t port) {
+	tls_pin_t* pin;
+	if (host == NULL || pins.buckets == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&pins.mutex);
+	if (*find_slot(host, port) != NULL) {
+		pthread_mutex_unlock(&pins.mutex);
+		return;
+	}
+	pin = insert_pin(host, port);
+	if (pin != NULL) {
+		pin->pending_next = pins.pending;
+		pins.pending = pin;
+		pins.pending_count++;
+		/* Start the flush interval, or cut it short for a full batch */
+		if (pins.pending_count == 1 || pins.pending_count == TLS_PINS_BATCH_SIZE) {
+			pthread_cond_signal(&pins.wake);
+		}
+	}
+	pthread_mutex_unlock(&pins.mutex);
+	return;
+}
+
+/**
+ * Whether host was seen speaking TLS on port, now or in an earlier run.
+ * Never touches the database.
+ * @returns 1 if it was, 0 otherwise
+ */
+int tls_pins_contains(const char* host, uint16_t port) {
+	pin_bloom_t* bloom;
+	int found;
+	if (host == NULL || pins.buckets == NULL) {
+		return 0;
+	}
+	bloom = __atomic_load_n(&pins.bloom, __ATOMIC_ACQUIRE);
+	if (bloom != NULL && !bloom_test(bloom, hash_pin(host, port))) {
+		return 0;
+	}
+	pthread_mutex_lock(&pins.mutex);
+	found = *find_slot(host, port) != NULL;
+	pthread_mutex_unlock(&pins.mutex);
+	return found;
+}
+
+void* writer_thread(void* arg) {
+	struct timespec deadline;
+	tls_pin_t* batch;
+	int running;
+	while (1) {
+		pthread_mutex_lock(&pins.mutex);
+		while (pins.pending == NULL && pins.running) {
+			pthread_cond_wait(&pins.wake, &pins.mutex);
+		}
+		/* Let a batch gather unless it is already full */
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += TLS_PINS_FLUSH_INTERVAL / 1000;
+		deadline.tv_nsec += (TLS_PINS_FLUSH_INTERVAL % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (pins.running && pins.pending_count < TLS_PINS_BATCH_SIZE) {
+			if (pthread_cond_timedwait(&pins.wake, &pins.mutex, &deadline) == ETIMEDOUT) {
+				break;
+			}
+		}
+		batch = pins.pending;
+		pins.pending = NULL;
+		pins.pending_count = 0;
+		running = pins.running;
+		pthread_mutex_unlock(&pins.mutex);
+		if (batch != NULL) {
+			write_batch(batch);
+		}
+		if (!running) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Inserts a list of pins in one transaction.  Pins are never freed while
+ * the writer runs, so the list is read without the lock */
+void write_batch(tls_pin_t* batch) {
+	tls_pin_t* pin;
+	int count;
+	if (sqlite3_exec(pins.write_db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+		tblog(LOG_ERROR, "TLS Pin insert failed %s", sqlite3_errmsg(pins.write_db));
+		return;
+	}
+	count = 0;
+	for (pin = batch; pin != NULL; pin = pin->pending_next) {
+		sqlite3_bind_text(pins.insert, 1, pin->host, -1, SQLITE_STATIC);
+		sqlite3_bind_int(pins.insert, 2, pin->port);
+		if (sqlite3_step(pins.insert) != SQLITE_DONE) {
+			tblog(LOG_ERROR, "TLS Pin insert failed %s", sqlite3_errmsg(pins.write_db));
+		}
+		else {
+			count++;
+		}
+		sqlite3_reset(pins.insert);
+	}
+	sqlite3_clear_bindings(pins.insert);
+	if (sqlite3_exec(pins.write_db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		tblog(LOG_ERROR, "TLS Pin commit failed %s", sqlite3_errmsg(pins.write_db));
+		sqlite3_exec(pins.write_db, "ROLLBACK", NULL, NULL, NULL);
+		return;
+	}
+	tblog(LOG_DEBUG, "Wrote %d TLS pins", count);
+	return;
+}
+
+/* Returns the link pointing at the pin, or at the NULL ending its bucket.
+ * Caller must hold the mutex */
+tls_pin_t** find_slot(const char* host, uint16_t port) {
+	tls_pin_t** slot;
+	slot = &pins.buckets[hash_pin(host, port) & pins.mask];
+	while (*slot != NULL && ((*slot)->port != port || strcmp((*slot)->host, host) != 0)) {
+		slot = &(*slot)->hash_next;
+	}
+	return slot;
+}
+
+/* Adds a pin known to be missing.  Caller must hold the mutex */
+tls_pin_t* insert_pin(const char* host, uint16_t port) {
+	tls_pin_t** slot;
+	tls_pin_t* pin;
+	pin_bloom_t* bloom;
+	size_t len;
+	size_t i;
+	len = strlen(host) + 1;
+	pin = (tls_pin_t*)malloc(sizeof(tls_pin_t) + len);
+	if (pin == NULL) {
+		tblog(LOG_WARNING, "Could not allocate tls pin");
+		return NULL;
+	}
+	pin->pending_next = NULL;
+	pin->port = port;
+	memcpy(pin->host, host, len);
+	if (pins.count >= (pins.mask + 1) * 2) {
+		grow_buckets();
+	}
+	slot = find_slot(host, port);
+	pin->hash_next = *slot;
+	*slot = pin;
+	pins.count++;
+
+	if (pins.bloom != NULL && pins.count > pins.bloom->capacity) {
+		/* Lookups may still be reading the old filter */
+		bloom = bloom_create(pins.bloom->capacity * 2);
+		if (bloom != NULL) {
+			for (i = 0; i <= pins.mask; i++) {
+				for (pin = pins.buckets[i]; pin != NULL; pin = pin->hash_next) {
+					bloom_add(bloom, hash_pin(pin->host, pin->port));
+				}
+			}
+			pins.bloom->retired_next = pins.retired;
+			pins.retired = pins.bloom;
+			__atomic_store_n(&pins.bloom, bloom, __ATOMIC_RELEASE);
+		}
+		pin = *find_slot(host, port);
+	}
+	else if (pins.bloom != NULL) {
+		bloom_add(pins.bloom, hash_pin(host, port));
+	}
+	return pin;
+}
+
+/* Doubles the buckets, keeping the old ones if that fails.  Caller must
+ * hold the mutex */
+void grow_buckets(void) {
+	tls_pin_t** buckets;
+	tls_pin_t* pin;
+	tls_pin_t* next;
+	size_t mask;
+	size_t i;
+	mask = (pins.mask << 1) | 1;
+	buckets = (tls_pin_t**)calloc(mask + 1, sizeof(tls_pin_t*));
+	if (buckets == NULL) {
+		return;
+	}
+	for (i = 0; i <= pins.mask; i++) {
+		for (pin = pins.buckets[i]; pin != NULL; pin = next) {
+			next = pin->hash_next;
+			pin->hash_next = buckets[hash_pin(pin->host, pin->port) & mask];
+			buckets[hash_pin(pin->host, pin->port) & mask] = pin;
+		}
+	}
+	free(pins.buckets);
+	pins.buckets = buckets;
+	pins.mask = mask;
+	return;
+}
+
+/* Reads every pin from the database into the set and sizes the filter
+ * for them.  Runs before the writer starts */
+int load_pins(void) {
+	sqlite3_stmt* statement;
+	tls_pin_t* pin;
+	size_t capacity;
+	size_t i;
+	int rc;
+	if (sqlite3_prepare_v2(pins.write_db, "SELECT Hostname, Port FROM Pins", -1, &statement, NULL) != SQLITE_OK) {
+		tblog(LOG_ERROR, "Failed to read tls pins, %s", sqlite3_errmsg(pins.write_db));
+		return 1;
+	}
+	while ((rc = sqlite3_step(statement)) == SQLITE_ROW) {
+		if (sqlite3_column_text(statement, 0) == NULL) {
+			continue;
+		}
+		insert_pin((const char*)sqlite3_column_text(statement, 0), (uint16_t)sqlite3_column_int(statement, 1));
+	}
+	sqlite3_finalize(statement);
+	if (rc != SQLITE_DONE) {
+		tblog(LOG_ERROR, "Failed to read tls pins, %s", sqlite3_errmsg(pins.write_db));
+		return 1;
+	}
+	capacity = BLOOM_MIN_PINS;
+	while (capacity < pins.count * 2) {
+		capacity <<= 1;
+	}
+	pins.bloom = bloom_create(capacity);
+	if (pins.bloom != NULL) {
+		for (i = 0; i <= pins.mask; i++) {
+			for (pin = pins.buckets[i]; pin != NULL; pin = pin->hash_next) {
+				bloom_add(pins.bloom, hash_pin(pin->host, pin->port));
+			}
+		}
+	}
+	tblog(LOG_INFO, "Loaded %zu TLS pins", pins.count);
+	return 0;
+}
+
+/* Without a filter every lookup takes the lock, which is still correct */
+pin_bloom_t* bloom_create(size_t capacity) {
+	pin_bloom_t* bloom;
+	size_t bits;
+	bits = capacity * BLOOM_BITS_PER_PIN;
+	bloom = (pin_bloom_t*)calloc(1, sizeof(pin_bloom_t) + bits / 8);
+	if (bloom == NULL) {
+		tblog(LOG_WARNING, "Could not allocate filter for %zu tls pins", capacity);
+		return NULL;
+	}
+	bloom->capacity = capacity;
+	bloom->mask = bits - 1;
+	return bloom;
+}
+
+/* Bit positions come from double hashing the pin's hash */
+void bloom_add(pin_bloom_t* bloom, size_t hash) {
+	size_t step;
+	size_t bit;
+	int i;
+	step = (hash >> 32) | 1;
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		bit = (hash + i * step) & bloom->mask;
+		__atomic_or_fetch(&bloom->words[bit / 64], (uint64_t)1 << (bit % 64), __ATOMIC_RELAXED);
+	}
+	return;
+}
+
+int bloom_test(pin_bloom_t* bloom, size_t hash) {
+	size_t step;
+	size_t bit;
+	int i;
+	step = (hash >> 32) | 1;
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		bit = (hash + i * step) & bloom->mask;
+		if (!(__atomic_load_n(&bloom->words[bit / 64], __ATOMIC_RELAXED) & ((uint64_t)1 << (bit % 64)))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* FNV-1a over the host and port */
+size_t hash_pin(const char* host, uint16_t port) {
+	size_t hash;
+	hash = 14695981039346656037ULL;
+	while (*host != '\0') {
+		hash = (hash ^ (unsigned char)*host++) * 1099511628211ULL;
+	}
+	hash = (hash ^ (port & 0xff)) * 1099511628211ULL;
+	hash = (hash ^ (port >> 8)) * 1099511628211ULL;
+	return hash;
+}
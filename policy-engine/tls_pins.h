@@ -0,0 +1,17 @@
+#ifndef _TLS_PINS_H
+#define _TLS_PINS_H
+
+#include <stdint.h>
+
+#define TLS_PINS_DATABASE	"/var/log/tls_pinning.db"
+/* Longest time a new pin waits before it is written, in milliseconds */
+#define TLS_PINS_FLUSH_INTERVAL	1000
+/* Pins written in one transaction at most */
+#define TLS_PINS_BATCH_SIZE	512
+
+int tls_pins_init(const char* path);
+void tls_pins_close(void);
+void tls_pins_add(const char* host, uint16_t port);
+int tls_pins_contains(const char* host, uint16_t port);
+
+#endif
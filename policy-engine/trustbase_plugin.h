@@ -12,11 +12,18 @@
 #define PLUGIN_RESPONSE_INVALID	0
 #define PLUGIN_RESPONSE_ABSTAIN	2
 
+/* Digests of chain certificates, see init_data_t.fingerprint */
+#define PLUGIN_DIGEST_CERT_SHA1		0 /* SHA-1 of the certificate */
+#define PLUGIN_DIGEST_CERT_SHA256	1 /* SHA-256 of the certificate */
+#define PLUGIN_DIGEST_SPKI_SHA256	2 /* SHA-256 of its SubjectPublicKeyInfo */
+#define PLUGIN_DIGEST_KINDS		3
+#define PLUGIN_DIGEST_MAX_LEN		32
+
 typedef struct query_data_t {
 	int id;
 	char* hostname;
 	uint16_t port;
-	STACK_OF(X509)* chain;
+	STACK_OF(X509)* chain; /* only set for plugins with openssl = 1 */
 	unsigned char* raw_chain;
 	size_t raw_chain_len;
 	char* client_hello;
@@ -28,8 +35,27 @@ typedef struct query_data_t {
 typedef struct init_data_t {
 	int plugin_id;
 	char* plugin_path;
+	/* Asynchronous plugins may use the query_data_t they were given until
+	 * they call this for its query, even after a timeout, and must call it
+	 * exactly once per query unless their query function returned
+	 * PLUGIN_RESPONSE_ERROR */
 	int(*callback)(int plugin_id, int query_id, int plugin_response);
 	int (*tblog)(tblog_level_t level, const char* format, ...);
+	/* Writes a PLUGIN_DIGEST_* digest of the certificate at cert_index in
+	 * the chain (0 is the leaf) into digest, which must hold
+	 * PLUGIN_DIGEST_MAX_LEN bytes.  data is the query_data_t the plugin
+	 * was given.  Each digest is computed at most once per query and
+	 * shared by all plugins.  Returns its length, or 0 on failure */
+	int (*fingerprint)(query_data_t* data, int cert_index, int kind, unsigned char* digest);
 } init_data_t;
 
+/* Besides query, plugins may export:
+ *   int initialize(init_data_t* idata);
+ *   int finalize(void);
+ *   int cancel(int query_id);  called from any thread once the query's
+ *       verdict no longer depends on the plugin, so it can stop working
+ *       on it.  Asynchronous plugins must still call back for it.
+ *   int thread_safe = 1;  if query may run on several threads at once
+ */
+
 #endif
@@ -0,0 +1,281 @@
+/*
+ * Cache of recent verdicts, keyed by hostname, port and certificate chain.
+ *
+ * Besides the final verdict an entry remembers each plugin's response and
+ * the CA system's, so that a query whose verdict could not be cached (for
+ * instance because a plugin timed out or opted out of caching) only has
+ * to ask the parties whose answers are missing.  Entries live for the
+ * configured TTL but never past the leaf certificate's expiry, and the
+ * least recently used entry is evicted when the cache is full.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include "tb_logging.h"
+#include "verdict_cache.h"
+
+static verdict_entry_t** find_slot(verdict_cache_t* cache, const unsigned char* key);
+static void lru_unlink(verdict_cache_t* cache, verdict_entry_t* entry);
+static void lru_push(verdict_cache_t* cache, verdict_entry_t* entry);
+static void remove_entry(verdict_cache_t* cache, verdict_entry_t* entry);
+static time_t now_seconds(void);
+
+/**
+ * Create a new empty cache
+ * @param capacity maximum number of entries
+ * @param ttl maximum lifetime of an entry in seconds
+ * @param plugin_count number of plugin responses kept per entry
+ * @returns cache pointer or NULL on failure
+ */
+verdict_cache_t* verdict_cache_create(size_t capacity, unsigned int ttl, int plugin_count) {
+	verdict_cache_t* cache;
+	size_t buckets;
+	buckets = 2;
+	while (buckets < capacity) {
+		buckets <<= 1;
+	}
+	cache = (verdict_cache_t*)calloc(1, sizeof(verdict_cache_t));
+	if (cache == NULL) {
+		tblog(LOG_ERROR, "Failed to allocate space for verdict cache");
+		return NULL;
+	}
+	cache->buckets = (verdict_entry_t**)calloc(buckets, sizeof(verdict_entry_t*));
+	if (cache->buckets == NULL) {
+		tblog(LOG_ERROR, "Failed to allocate %zu buckets for verdict cache", buckets);
+		free(cache);
+		return NULL;
+	}
+	if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+		tblog(LOG_ERROR, "Failed to create mutex for verdict cache");
+		free(cache->buckets);
+		free(cache);
+		return NULL;
+	}
+	cache->bucket_mask = buckets - 1;
+	cache->capacity = capacity;
+	cache->ttl = ttl;
+	cache->plugin_count = plugin_count;
+	return cache;
+}
+
+/**
+ * Frees the cache and every entry in it
+ */
+void verdict_cache_free(verdict_cache_t* cache) {
+	verdict_entry_t* entry;
+	verdict_entry_t* next;
+	if (cache == NULL) {
+		return;
+	}
+	entry = cache->lru_head;
+	while (entry != NULL) {
+		next = entry->lru_next;
+		free(entry);
+		entry = next;
+	}
+	pthread_mutex_destroy(&cache->mutex);
+	free(cache->buckets);
+	free(cache);
+	return;
+}
+
+/**
+ * Computes the cache key of a connection
+ * @param key buffer of VERDICT_CACHE_KEY_LEN bytes receiving the key
+ */
+void verdict_cache_key(unsigned char* key, const char* hostname, uint16_t port, const unsigned char* raw_chain, size_t len) {
+	EVP_MD_CTX* ctx;
+	unsigned char port_bytes[2];
+	port_bytes[0] = port >> 8;
+	port_bytes[1] = port & 0xff;
+	ctx = EVP_MD_CTX_create();
+	EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+	/* Include the terminator so hostname and port cannot run together */
+	EVP_DigestUpdate(ctx, hostname, strlen(hostname) + 1);
+	EVP_DigestUpdate(ctx, port_bytes, sizeof(port_bytes));
+	EVP_DigestUpdate(ctx, raw_chain, len);
+	EVP_DigestFinal_ex(ctx, key, NULL);
+	EVP_MD_CTX_destroy(ctx);
+	return;
+}
+
+/**
+ * Looks up what is known about a connection
+ * @param verdict receives the cached final verdict or VERDICT_UNKNOWN
+ * @param responses if not NULL, receives every plugin's cached response
+ * or VERDICT_UNKNOWN
+ * @param ca_response if not NULL, receives the CA system's cached
+ * response or VERDICT_UNKNOWN
+ * @returns 1 if the cache has an entry for the key, 0 otherwise
+ */
+int verdict_cache_lookup(verdict_cache_t* cache, const unsigned char* key, int* verdict, int* responses, int* ca_response) {
+	verdict_entry_t* entry;
+	pthread_mutex_lock(&cache->mutex);
+	entry = *find_slot(cache, key);
+	if (entry != NULL && entry->expires <= now_seconds()) {
+		remove_entry(cache, entry);
+		entry = NULL;
+	}
+	if (entry == NULL) {
+		pthread_mutex_unlock(&cache->mutex);
+		return 0;
+	}
+	lru_unlink(cache, entry);
+	lru_push(cache, entry);
+	*verdict = entry->verdict;
+	if (responses != NULL) {
+		memcpy(responses, entry->responses, sizeof(int) * cache->plugin_count);
+	}
+	if (ca_response != NULL) {
+		*ca_response = entry->ca_response;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+	return 1;
+}
+
+/**
+ * Records what was learned about a connection.  Known values are merged
+ * into an existing entry, which keeps its original expiry so that answers
+ * taken from the cache are never kept alive past their TTL.
+ * @param max_lifetime seconds the entry may live at most, e.g. until the
+ * leaf certificate expires
+ * @param verdict final verdict or VERDICT_UNKNOWN
+ * @param responses each plugin's response or VERDICT_UNKNOWN
+ * @param ca_response the CA system's response or VERDICT_UNKNOWN
+ */
+void verdict_cache_store(verdict_cache_t* cache, const unsigned char* key, unsigned int max_lifetime, int verdict, const int* responses, int ca_response) {
+	verdict_entry_t** slot;
+	verdict_entry_t* entry;
+	time_t now;
+	int i;
+	if (max_lifetime > cache->ttl) {
+		max_lifetime = cache->ttl;
+	}
+	if (max_lifetime == 0 || cache->capacity == 0) {
+		return;
+	}
+	now = now_seconds();
+	pthread_mutex_lock(&cache->mutex);
+	slot = find_slot(cache, key);
+	entry = *slot;
+	if (entry != NULL && entry->expires <= now) {
+		remove_entry(cache, entry);
+		slot = find_slot(cache, key);
+		entry = NULL;
+	}
+	if (entry == NULL) {
+		if (cache->count >= cache->capacity) {
+			remove_entry(cache, cache->lru_tail);
+			slot = find_slot(cache, key);
+		}
+		entry = (verdict_entry_t*)malloc(sizeof(verdict_entry_t) + sizeof(int) * cache->plugin_count);
+		if (entry == NULL) {
+			pthread_mutex_unlock(&cache->mutex);
+			tblog(LOG_ERROR, "Failed to allocate verdict cache entry");
+			return;
+		}
+		memcpy(entry->key, key, VERDICT_CACHE_KEY_LEN);
+		entry->expires = now + max_lifetime;
+		entry->verdict = VERDICT_UNKNOWN;
+		entry->ca_response = VERDICT_UNKNOWN;
+		for (i = 0; i < cache->plugin_count; i++) {
+			entry->responses[i] = VERDICT_UNKNOWN;
+		}
+		entry->hash_next = NULL;
+		*slot = entry;
+		cache->count++;
+	}
+	else {
+		lru_unlink(cache, entry);
+	}
+	lru_push(cache, entry);
+
+	if (verdict != VERDICT_UNKNOWN) {
+		entry->verdict = verdict;
+	}
+	if (ca_response != VERDICT_UNKNOWN) {
+		entry->ca_response = ca_response;
+	}
+	for (i = 0; i < cache->plugin_count; i++) {
+		if (responses[i] != VERDICT_UNKNOWN) {
+			entry->responses[i] = responses[i];
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+	return;
+}
+
+/**
+ * Forgets every entry, e.g. because the CA system's answers may have
+ * changed
+ */
+void verdict_cache_flush(verdict_cache_t* cache) {
+	pthread_mutex_lock(&cache->mutex);
+	while (cache->lru_tail != NULL) {
+		remove_entry(cache, cache->lru_tail);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+	return;
+}
+
+/* Returns the link pointing at the entry for key, or at the NULL ending
+ * its bucket.  Caller must hold the cache mutex */
+verdict_entry_t** find_slot(verdict_cache_t* cache, const unsigned char* key) {
+	verdict_entry_t** slot;
+	size_t hash;
+	memcpy(&hash, key, sizeof(hash));
+	slot = &cache->buckets[hash & cache->bucket_mask];
+	while (*slot != NULL && memcmp((*slot)->key, key, VERDICT_CACHE_KEY_LEN) != 0) {
+		slot = &(*slot)->hash_next;
+	}
+	return slot;
+}
+
+/* Caller must hold the cache mutex */
+void remove_entry(verdict_cache_t* cache, verdict_entry_t* entry) {
+	verdict_entry_t** slot;
+	slot = find_slot(cache, entry->key);
+	*slot = entry->hash_next;
+	lru_unlink(cache, entry);
+	cache->count--;
+	free(entry);
+	return;
+}
+
+void lru_unlink(verdict_cache_t* cache, verdict_entry_t* entry) {
+	if (entry->lru_prev != NULL) {
+		entry->lru_prev->lru_next = entry->lru_next;
+	}
+	else {
+		cache->lru_head = entry->lru_next;
+	}
+	if (entry->lru_next != NULL) {
+		entry->lru_next->lru_prev = entry->lru_prev;
+	}
+	else {
+		cache->lru_tail = entry->lru_prev;
+	}
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+	return;
+}
+
+void lru_push(verdict_cache_t* cache, verdict_entry_t* entry) {
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head != NULL) {
+		cache->lru_head->lru_prev = entry;
+	}
+	else {
+		cache->lru_tail = entry;
+	}
+	cache->lru_head = entry;
+	return;
+}
+
+time_t now_seconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
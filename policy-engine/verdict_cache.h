@@ -0,0 +1,44 @@
+#ifndef _VERDICT_CACHE_H
+#define _VERDICT_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <openssl/sha.h>
+
+#define VERDICT_CACHE_KEY_LEN	SHA256_DIGEST_LENGTH
+/* Marks a verdict or plugin response the cache does not know */
+#define VERDICT_UNKNOWN		(-2)
+
+typedef struct verdict_entry_t {
+	struct verdict_entry_t* hash_next;
+	struct verdict_entry_t* lru_prev;
+	struct verdict_entry_t* lru_next;
+	unsigned char key[VERDICT_CACHE_KEY_LEN];
+	time_t expires; /* CLOCK_MONOTONIC seconds */
+	int verdict; /* final policy response, or VERDICT_UNKNOWN */
+	int ca_response;
+	int responses[]; /* one per plugin */
+} verdict_entry_t;
+
+typedef struct verdict_cache_t {
+	pthread_mutex_t mutex;
+	verdict_entry_t** buckets;
+	size_t bucket_mask;
+	verdict_entry_t* lru_head; /* most recently used */
+	verdict_entry_t* lru_tail;
+	size_t count;
+	size_t capacity;
+	unsigned int ttl;
+	int plugin_count;
+} verdict_cache_t;
+
+verdict_cache_t* verdict_cache_create(size_t capacity, unsigned int ttl, int plugin_count);
+void verdict_cache_free(verdict_cache_t* cache);
+void verdict_cache_key(unsigned char* key, const char* hostname, uint16_t port, const unsigned char* raw_chain, size_t len);
+int verdict_cache_lookup(verdict_cache_t* cache, const unsigned char* key, int* verdict, int* responses, int* ca_response);
+void verdict_cache_flush(verdict_cache_t* cache);
+void verdict_cache_store(verdict_cache_t* cache, const unsigned char* key, unsigned int max_lifetime, int verdict, const int* responses, int ca_response);
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ * Measures the cost of the policy engine's in-flight query lookups
+ * (what every async plugin callback pays) as the number of outstanding
+ * queries grows.  Run from the repository root: ./inflight_benchmark
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../policy-engine/query.h"
+#include "../policy-engine/query_index.h"
+
+#define LOOKUPS_PER_RUN	(2000000)
+
+static double elapsed_ns(struct timespec* start, struct timespec* end);
+static void run(int in_flight);
+
+int main() {
+	int sizes[] = { 10, 100, 1000, 10000, 100000 };
+	int i;
+	printf("%10s %18s %18s\n", "in-flight", "lookup (ns/op)", "add+remove (ns/op)");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		run(sizes[i]);
+	}
+	return 0;
+}
+
+void run(int in_flight) {
+	query_index_t* index;
+	query_t* queries;
+	query_data_t* data;
+	struct timespec start;
+	struct timespec end;
+	double lookup_ns;
+	double churn_ns;
+	int oldest;
+	int next_id;
+	int i;
+	int found;
+
+	index = index_create(1 << 17);
+	/* Twice as many objects as are in flight so retired ones can be reused */
+	queries = (query_t*)calloc(2 * in_flight, sizeof(query_t));
+	data = (query_data_t*)calloc(2 * in_flight, sizeof(query_data_t));
+	if (index == NULL || queries == NULL || data == NULL) {
+		fprintf(stderr, "unable to allocate benchmark data\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < 2 * in_flight; i++) {
+		queries[i].data = &data[i];
+		/* Lookups only find queries someone holds a reference on */
+		queries[i].refcount = 1;
+	}
+	for (next_id = 0; next_id < in_flight; next_id++) {
+		data[next_id].id = next_id;
+		index_add(index, &queries[next_id]);
+	}
+
+	/* Async callbacks arriving for random outstanding queries */
+	found = 0;
+	srand(1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < LOOKUPS_PER_RUN; i++) {
+		if (index_get(index, rand() % in_flight) != NULL) {
+			found++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	lookup_ns = elapsed_ns(&start, &end) / LOOKUPS_PER_RUN;
+	if (found != LOOKUPS_PER_RUN) {
+		fprintf(stderr, "lost %d queries\n", LOOKUPS_PER_RUN - found);
+	}
+
+	/* Queries finishing in order while new ones arrive */
+	oldest = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < LOOKUPS_PER_RUN; i++) {
+		index_remove(index, oldest);
+		queries[next_id % (2 * in_flight)].data->id = next_id;
+		index_add(index, &queries[next_id % (2 * in_flight)]);
+		oldest++;
+		next_id++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	churn_ns = elapsed_ns(&start, &end) / LOOKUPS_PER_RUN;
+
+	printf("%10d %18.1f %18.1f\n", in_flight, lookup_ns, churn_ns);
+	index_free(index);
+	free(queries);
+	free(data);
+	return;
+}
+
+double elapsed_ns(struct timespec* start, struct timespec* end) {
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}